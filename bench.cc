@@ -0,0 +1,236 @@
+// Copyright 2016 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Writer throughput benchmark: prints one JSON object per line, so that two
+// runs can be compared with diff or loaded with pandas.read_json(lines=True).
+//
+//     ./benchme [output-directory] [rows]
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "c2numpy.h"
+
+static std::string outputDirectory = "/tmp";
+static int64_t numRows = 1000000;
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t fileSize(const std::string &fileName) {
+  struct stat info;
+  if (stat(fileName.c_str(), &info) != 0)
+    return 0;
+  return info.st_size;
+}
+
+// total size of all files written under a prefix (data files and sidecars, such as categories),
+// which are removed
+static int64_t prefixSize(const std::string &prefix) {
+  size_t slash = prefix.rfind('/');
+  std::string directory = slash == std::string::npos ? "./" : prefix.substr(0, slash + 1);
+  std::string start = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+
+  std::vector<std::string> fileNames;
+  DIR *dir = opendir(directory.c_str());
+  if (dir == NULL)
+    return 0;
+  for (struct dirent *entry = readdir(dir);  entry != NULL;  entry = readdir(dir))
+    if (std::string(entry->d_name).compare(0, start.size(), start) == 0)
+      fileNames.push_back(directory + entry->d_name);
+  closedir(dir);
+
+  int64_t total = 0;
+  for (size_t i = 0;  i < fileNames.size();  ++i) {
+    total += fileSize(fileNames[i]);
+    remove(fileNames[i].c_str());
+  }
+  return total;
+}
+
+static void report(const char *benchmark, const char *schema, int64_t rows, int32_t rowsPerFile, int64_t bytes, double seconds) {
+  printf("{\"benchmark\": \"%s\", \"schema\": \"%s\", \"rows\": %" PRId64 ", \"rowsPerFile\": %d, \"bytes\": %" PRId64 ", \"seconds\": %.6f, \"rowsPerSecond\": %.1f, \"bytesPerSecond\": %.1f}\n",
+         benchmark, schema, rows, rowsPerFile, bytes, seconds, rows / seconds, bytes / seconds);
+  fflush(stdout);
+}
+
+//////////////////////////////////////////////////////////////// schemas
+
+// narrow: a handful of integer columns (like run, lumi, event numbers)
+static void narrowColumns(c2numpy_writer *writer) {
+  c2numpy_addcolumn(writer, "run", C2NUMPY_INT32);
+  c2numpy_addcolumn(writer, "lumi", C2NUMPY_INT32);
+  c2numpy_addcolumn(writer, "evt", C2NUMPY_INT64);
+  c2numpy_addcolumn(writer, "index", C2NUMPY_UINT16);
+}
+
+static void narrowRow(c2numpy_writer *writer, int64_t i) {
+  c2numpy_int32(writer, 1);
+  c2numpy_int32(writer, (int32_t)(i / 1000));
+  c2numpy_int64(writer, i);
+  c2numpy_uint16(writer, (uint16_t)i);
+}
+
+// wide: the track parameters and hit coordinates of examples/CMSSW-with-C-interface
+static const int wideInts = 5;
+static const int wideFloats = 20 + 3*5 + 3*50;
+
+static void wideColumns(c2numpy_writer *writer) {
+  for (int j = 0;  j < wideInts;  ++j) {
+    std::stringstream name;
+    name << "i" << j;
+    c2numpy_addcolumn(writer, name.str(), C2NUMPY_INTC);
+  }
+  for (int j = 0;  j < wideFloats;  ++j) {
+    std::stringstream name;
+    name << "f" << j;
+    c2numpy_addcolumn(writer, name.str(), C2NUMPY_FLOAT64);
+  }
+}
+
+static void wideRow(c2numpy_writer *writer, int64_t i) {
+  for (int j = 0;  j < wideInts;  ++j)
+    c2numpy_intc(writer, (int)(i + j));
+  for (int j = 0;  j < wideFloats;  ++j)
+    c2numpy_float64(writer, i * 0.5 + j);
+}
+
+// string-heavy: labels such as detector names and trigger paths (padded, since c2numpy_string writes the full width)
+static const char labels[][41] = {"HLT_IsoMu24_v4", "HLT_Ele27_WPTight_Gsf_v7", "HLT_PFJet450_v9", "TIB", "TOB", "TEC", "TID", "BPIX", "FPIX"};
+
+static void stringColumns(c2numpy_writer *writer) {
+  c2numpy_addcolumn(writer, "evt", C2NUMPY_INT64);
+  c2numpy_addcolumn(writer, "path", (c2numpy_type)(C2NUMPY_STRING + 40));
+  c2numpy_addcolumn(writer, "detector", (c2numpy_type)(C2NUMPY_STRING + 8));
+  c2numpy_addcolumn(writer, "comment", (c2numpy_type)(C2NUMPY_STRING + 150));
+}
+
+static void stringRow(c2numpy_writer *writer, int64_t i) {
+  static char comment[150] = "";
+  c2numpy_int64(writer, i);
+  c2numpy_string(writer, labels[i % 3]);
+  c2numpy_string(writer, labels[3 + i % 6]);
+  c2numpy_string(writer, comment);
+}
+
+// the same labels as C2NUMPY_CATEGORY codes (the comment stays a fixed-width string)
+static void categoryColumns(c2numpy_writer *writer) {
+  c2numpy_addcolumn(writer, "evt", C2NUMPY_INT64);
+  c2numpy_addcolumn(writer, "path", C2NUMPY_CATEGORY);
+  c2numpy_addcolumn(writer, "detector", C2NUMPY_CATEGORY);
+  c2numpy_addcolumn(writer, "comment", (c2numpy_type)(C2NUMPY_STRING + 150));
+}
+
+static void categoryRow(c2numpy_writer *writer, int64_t i) {
+  static char comment[150] = "";
+  c2numpy_int64(writer, i);
+  c2numpy_category(writer, labels[i % 3]);
+  c2numpy_category(writer, labels[3 + i % 6]);
+  c2numpy_string(writer, comment);
+}
+
+typedef struct {
+  const char *name;
+  void (*columns)(c2numpy_writer *writer);
+  void (*row)(c2numpy_writer *writer, int64_t i);
+  int64_t rowScale;   // divide numRows by this to keep each benchmark in the same ballpark
+} schema;
+
+static const schema schemas[] = {
+  {"narrow", narrowColumns, narrowRow, 1},
+  {"wide", wideColumns, wideRow, 50},
+  {"string", stringColumns, stringRow, 10},
+  {"category", categoryColumns, categoryRow, 10}
+};
+
+//////////////////////////////////////////////////////////////// benchmarks
+
+// scalar setters from the first item to c2numpy_close, with rotation every rowsPerFile rows
+static void benchWriter(const schema &s, int32_t rowsPerFile) {
+  std::string prefix = outputDirectory + "/c2numpy-bench-" + s.name + "-";
+  int64_t rows = numRows / s.rowScale;
+
+  c2numpy_writer writer;
+  c2numpy_init(&writer, prefix, rowsPerFile);
+  s.columns(&writer);
+
+  double start = now();
+  for (int64_t i = 0;  i < rows;  ++i)
+    s.row(&writer, i);
+  double beforeClose = now();
+  c2numpy_close(&writer);
+  double end = now();
+
+  int64_t bytes = prefixSize(prefix);
+  report("setters", s.name, rows, rowsPerFile, bytes, beforeClose - start);
+  report("setters+close", s.name, rows, rowsPerFile, bytes, end - start);
+}
+
+// lower bound: the same number of bytes with one fwrite per row and no rotation
+static void benchFwrite(const schema &s) {
+  std::string prefix = outputDirectory + "/c2numpy-bench-" + s.name + "-";
+  int64_t rows = numRows / s.rowScale;
+
+  // an empty file gives the header size; the record size follows from the descr strings
+  c2numpy_writer writer;
+  c2numpy_init(&writer, prefix, 1);
+  s.columns(&writer);
+  c2numpy_open(&writer);
+  c2numpy_close(&writer);
+  int64_t header = fileSize(prefix + "0.npy");
+  prefixSize(prefix);
+  size_t rowSize = 0;
+  for (int32_t column = 0;  column < writer.numColumns;  ++column)
+    rowSize += atoi(c2numpy_descr(writer.columnTypes[column]) + 2);
+
+  std::vector<char> record(rowSize, 1);
+  std::string fileName = prefix + "fwrite.npy";
+
+  double start = now();
+  FILE *file = fopen(fileName.c_str(), "wb");
+  std::vector<char> headerBytes(header, ' ');
+  fwrite(&headerBytes[0], 1, header, file);
+  for (int64_t i = 0;  i < rows;  ++i)
+    fwrite(&record[0], 1, rowSize, file);
+  fclose(file);
+  double end = now();
+
+  int64_t bytes = fileSize(fileName);
+  remove(fileName.c_str());
+  report("fwrite", s.name, rows, 0, bytes, end - start);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    outputDirectory = argv[1];
+  if (argc > 2)
+    numRows = atoll(argv[2]);
+
+  for (size_t i = 0;  i < sizeof(schemas) / sizeof(schemas[0]);  ++i) {
+    benchFwrite(schemas[i]);
+    benchWriter(schemas[i], 1000000);   // few files: setter cost dominates
+    benchWriter(schemas[i], 1000);      // many files: rotation (fclose/fopen/header) shows up
+    benchWriter(schemas[i], 10);        // rotation-dominated
+  }
+
+  return 0;
+}
@@ -15,14 +15,29 @@
 #ifndef C2NUMPY
 #define C2NUMPY
 
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <bitset>
+#include <deque>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#ifdef C2NUMPY_STATS
+#include <time.h>
+#endif
+
 const char* C2NUMPY_VERSION = "1.2";
 
 // http://docs.scipy.org/doc/numpy/user/basics.types.html
@@ -46,28 +61,546 @@ typedef enum {
     C2NUMPY_COMPLEX,     // Shorthand for complex128.
     C2NUMPY_COMPLEX64,   // Complex number, represented by two 32-bit floats (real and imaginary components)
     C2NUMPY_COMPLEX128,  // Complex number, represented by two 64-bit floats (real and imaginary components)
+    C2NUMPY_CATEGORY,    // String from a small set, written as an int32 code into <prefix><column>.categories.npy
 
     C2NUMPY_STRING       = 100,  // strings are C2NUMPY_STRING + their fixed size (up to 155)
     C2NUMPY_END          = 255   // ensure that c2numpy_type is at least a byte
 } c2numpy_type;
 
+#ifdef C2NUMPY_STATS
+// Optional instrumentation, compiled in only if C2NUMPY_STATS is defined before including this file.
+
+#define C2NUMPY_STATS_BINS 64
+
+// distribution of durations: bins[i] counts durations of at least 2**(i - 1) and less than 2**i nanoseconds
+typedef struct {
+    uint64_t count;               // number of timed calls
+    uint64_t totalNanoseconds;    // sum of all durations
+    uint64_t maxNanoseconds;      // longest duration
+    uint64_t bins[C2NUMPY_STATS_BINS];
+} c2numpy_histogram;
+
+typedef struct {
+    uint64_t rows;                // completed rows
+    uint64_t items;               // items (row, column cells) accepted by the c2numpy_* setters
+    uint64_t bytes;               // bytes handed to the sink, including headers
+    uint64_t writeCalls;          // number of writes and patches handed to the sink
+    uint64_t filesOpened;         // files opened (including the first)
+    uint64_t filesRotated;        // files closed because they reached numRowsPerFile
+
+    c2numpy_histogram writeTime;  // each c2numpy_* setter call
+    c2numpy_histogram openTime;   // sink open and header in c2numpy_open
+    c2numpy_histogram rotateTime; // flush and sink close of a full file when the last row is written
+    c2numpy_histogram closeTime;  // c2numpy_close
+} c2numpy_stats;
+
+// called every statsEveryRows rows, if set with c2numpy_stats_callback
+typedef void (*c2numpy_stats_function)(const c2numpy_stats *stats, void *userData);
+#endif // C2NUMPY_STATS
+
+// Destination for the bytes of each output file. The writer calls open, then any number of writes
+// (appending) and patches (overwriting bytes already written), then close. All return 0 on success.
+// A sink that cannot seek sets patch to NULL; the writer then holds each file in memory until it is
+// complete and writes it in one piece.
+typedef struct {
+    int (*open)(void *state, const char *fileName);
+    int (*write)(void *state, const void *data, size_t size);
+    int (*patch)(void *state, int64_t offset, const void *data, size_t size);
+    int (*close)(void *state);
+    void *state;
+} c2numpy_sink;
+
+// write-time reduction of a float64 column's precision (c2numpy_downcast, c2numpy_quantize, c2numpy_truncate)
+typedef enum {
+    C2NUMPY_NO_TRANSFORM,
+    C2NUMPY_DOWNCAST,             // to float32 or float16
+    C2NUMPY_QUANTIZE,             // to int8, int16 or int32: round((value - offset) / scale), clamped
+    C2NUMPY_TRUNCATE              // still float64, with the mantissa rounded to mantissaBits
+} c2numpy_transform_kind;
+
+typedef struct {
+    c2numpy_transform_kind kind;
+    c2numpy_type declared;        // the type given to c2numpy_addcolumn, which the setters take
+    double scale;
+    double offset;
+    int mantissaBits;
+} c2numpy_transform;
+
+// receives each chunk of a file as it is flushed (offset is its position in the file; a patch has an
+// offset before the end), then once more with data == NULL when the file is complete
+typedef int (*c2numpy_chunk_function)(void *userData, const char *fileName, int64_t offset, const void *data, size_t size);
+
+// running statistics of a column (c2numpy_summarize), over the rows of a file or of the whole run
+typedef struct {
+    int32_t column;
+    int64_t count;                // values that are neither null nor nan
+    int64_t nulls;
+    int64_t nans;
+    double mean;
+    double m2;                    // sum of squared differences from the mean (Welford), variance = m2 / count
+    double min;
+    double max;
+    double low;                   // histogram range, if bins is not empty
+    double high;
+    std::vector<int64_t> bins;    // underflow, the bins from low to high, overflow
+} c2numpy_summary;
+
+// decides whether a row is written (nonzero) from its bytes, as they will be stored (see c2numpy_offset)
+typedef int (*c2numpy_filter_function)(void *userData, const char *row);
+
 // a Numpy writer object
 typedef struct {
-    FILE *file;                   // output file handle
+    c2numpy_sink sink;            // where the bytes go; stdio files unless changed by c2numpy_use_*
+    FILE *file;                   // output file handle (stdio sink)
+    int fd;                       // output file descriptor (fd and stream sinks)
+    std::vector<std::string> memoryNames;   // names of completed and current files (memory sink)
+    std::vector<std::string> memoryFiles;   // contents of completed and current files (memory sink)
+    c2numpy_chunk_function chunkFunction;   // (internal) user callback (callback sink)
+    void *chunkUserData;          // (internal)
+    std::string chunkFileName;    // (internal) file the callback sink has open, which may be a sidecar
+
     std::string outputFilePrefix;       // output file name, not including the rotating number and .npy
+    std::string currentFileName;  // name of the file being written, if any
+    int fileOpen;                 // whether the sink has an open file
+    int64_t fileBytes;            // (internal) bytes already handed to the sink for the current file
+    std::vector<char> buffer;     // (internal) bytes not yet handed to the sink, always whole rows
+    size_t bufferUsed;            // (internal)
+    size_t bufferFlush;           // hand the buffer to the sink at the end of a row once it holds this many bytes
+    int holdFile;                 // (internal) keep the whole file in the buffer until it is finished
+    int64_t headerBytes;          // (internal) size of the current file's header
     int64_t sizeSeekPosition;     // (internal) keep track of number of rows to modify before closing
     int64_t sizeSeekSize;         // (internal)
 
     int32_t numColumns;           // number of columns in the record array
     std::vector<std::string> columnNames;           // column names
     std::vector<c2numpy_type> columnTypes;    // column types
+    std::vector<std::vector<std::string> > categories;   // strings of each C2NUMPY_CATEGORY column, in code order
+    std::vector<std::unordered_map<std::string, int32_t> > categoryCodes;   // (internal) the same, by string
+    std::vector<int64_t> categoriesWritten;   // (internal) how many of them the sidecar has (-1 before the first)
+    std::vector<int32_t> sortKeys;             // columns that each file is sorted by, most significant first (c2numpy_sortby)
+    std::string keyRanges;                     // (internal) contents of <prefix>keyranges.txt
+    std::vector<std::string> groupKeys;        // names of the keys of c2numpy_begin_group (c2numpy_groupby)
+    std::vector<int64_t> groups;               // (internal) each group's keys, file number, row in file and row overall
+    int64_t rowsFinished;                      // (internal) rows in the files already finished
+    int rowStage;                 // (internal) whether rows go through c2numpy_filter, c2numpy_prescale or c2numpy_sample
+    size_t rowSize;               // (internal) bytes per row, set when a file is opened
+    std::vector<c2numpy_filter_function> filters;   // a row is written only if all of them accept it
+    std::vector<void*> filterUserData;              // (internal)
+    int32_t prescaleColumn;       // column whose hash decides which rows c2numpy_prescale keeps, -1 if none
+    double prescaleFraction;      // (internal)
+    int64_t prescaleOffset;       // (internal) where the column is in a row, set when a file is opened
+    int prescaleSize;             // (internal)
+    int32_t sampleSize;           // rows that c2numpy_sample keeps of each file's numRowsPerFile, 0 to keep all
+    int32_t sampleSeen;           // (internal) rows offered to the current file's sample
+    uint64_t sampleState;         // (internal) random number generator state
+    std::vector<c2numpy_summary> fileSummaries;   // statistics of the c2numpy_summarize columns in the current file
+    std::vector<c2numpy_summary> runSummaries;    // and in all finished files
+    int64_t summarizedRows;       // (internal) rows of the current file already in fileSummaries
+    int checksums;                // compute the CRC32C of each file (c2numpy_checksums)
+    int64_t checksumBlockSize;    // and of each block of this many bytes, if not 0
+    std::string checksumHeader;   // (internal) the current file's header, which may still be patched
+    uint32_t checksum;            // (internal) CRC32C of the current file's bytes after the header so far
+    int64_t checksumBytes;        // (internal) how many bytes that is
+    uint32_t blockChecksum;       // (internal) CRC32C of the current block's bytes after the header so far
+    std::vector<uint32_t> blockChecksums;   // (internal) of the current file's finished blocks
+    std::string checksumManifest; // (internal) contents of <prefix>checksums.txt
+    std::vector<c2numpy_transform> transforms;   // precision reduction of each column, if any (columnTypes is what's stored)
+    std::vector<std::vector<std::string> > flagNames;   // bit names of each c2numpy_addflags column, bit 0 first
+    std::vector<int64_t> nullCounts;          // nulls in each column of the current file, -1 if the column isn't nullable
+    std::vector<std::vector<uint8_t> > nulls; // (internal) a bit per row of the current file, set if null
+    int matrix;                   // write a 2-D array of the (single) column type instead of a record array
+    int fortranOrder;             // (matrix only) write each file column by column
+    int arrowIPC;                 // write Arrow IPC files (.arrow) instead of .npy; see c2numpy_arrow_ipc
 
     int32_t numRowsPerFile;       // maximum number of rows per file
     int32_t currentColumn;        // current column number
     int32_t currentRowInFile;     // current row number in the current file
     int32_t currentFileNumber;    // current file number
+
+#ifdef C2NUMPY_STATS
+    c2numpy_stats stats;          // counters and timers, see c2numpy_stats_json
+    c2numpy_stats_function statsFunction;   // (internal) periodic callback
+    void *statsUserData;          // (internal)
+    uint64_t statsEveryRows;      // (internal)
+#endif
 } c2numpy_writer;
 
+#ifdef C2NUMPY_STATS
+inline uint64_t c2numpy_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+inline void c2numpy_histogram_fill(c2numpy_histogram *histogram, uint64_t nanoseconds) {
+    histogram->count += 1;
+    histogram->totalNanoseconds += nanoseconds;
+    if (nanoseconds > histogram->maxNanoseconds)
+        histogram->maxNanoseconds = nanoseconds;
+    histogram->bins[nanoseconds == 0 ? 0 : 64 - __builtin_clzll(nanoseconds)] += 1;
+}
+
+#define C2NUMPY_STATS_BEGIN(start) uint64_t start = c2numpy_nanoseconds();
+#define C2NUMPY_STATS_END(start, histogram) c2numpy_histogram_fill(&writer->stats.histogram, c2numpy_nanoseconds() - start);
+#define C2NUMPY_STATS_COUNT(counter, n) writer->stats.counter += (n);
+#else
+#define C2NUMPY_STATS_BEGIN(start)
+#define C2NUMPY_STATS_END(start, histogram)
+#define C2NUMPY_STATS_COUNT(counter, n)
+#endif
+
+//////////////////////////////////////////////////////////////// CRC32C checksums
+
+// CRC-32C (Castagnoli polynomial, reflected), as in iSCSI, ext4 and cloud storage object checksums
+#define C2NUMPY_CRC32C_POLY 0x82f63b78
+
+// 8 tables for slicing-by-8: table[k][byte] is the CRC of byte followed by k zero bytes
+struct c2numpy_crc32c_tables {
+    uint32_t table[8][256];
+    c2numpy_crc32c_tables() {
+        for (uint32_t byte = 0;  byte < 256;  ++byte) {
+            uint32_t crc = byte;
+            for (int bit = 0;  bit < 8;  ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ C2NUMPY_CRC32C_POLY : crc >> 1;
+            table[0][byte] = crc;
+        }
+        for (int k = 1;  k < 8;  ++k)
+            for (int byte = 0;  byte < 256;  ++byte)
+                table[k][byte] = (table[k - 1][byte] >> 8) ^ table[0][table[k - 1][byte] & 0xff];
+    }
+};
+
+inline uint32_t c2numpy_crc32c_portable(uint32_t crc, const char *data, size_t size) {
+    static const c2numpy_crc32c_tables tables;
+    const uint32_t (*t)[256] = tables.table;
+    uint32_t c = ~crc;
+    for (;  size >= 8;  data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);   // little-endian
+        word ^= c;
+        c = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+            t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    }
+    for (;  size > 0;  ++data, --size)
+        c = t[0][(c ^ (uint8_t)*data) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+#if defined(__x86_64__)  &&  (defined(__GNUC__)  ||  defined(__clang__))
+#include <nmmintrin.h>
+
+// the SSE4.2 crc32 instruction, 8 bytes at a time; only called if the CPU has it
+__attribute__((target("sse4.2"))) inline uint32_t c2numpy_crc32c_sse42(uint32_t crc, const char *data, size_t size) {
+    uint64_t c = ~crc;
+    for (;  size >= 8;  data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (;  size > 0;  ++data, --size)
+        c = _mm_crc32_u8((uint32_t)c, *data);
+    return ~(uint32_t)c;
+}
+
+// update a running CRC32C (0 to start) with size more bytes
+inline uint32_t c2numpy_crc32c(uint32_t crc, const void *data, size_t size) {
+    static const int sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return c2numpy_crc32c_sse42(crc, (const char*)data, size);
+    return c2numpy_crc32c_portable(crc, (const char*)data, size);
+}
+#else
+// update a running CRC32C (0 to start) with size more bytes
+inline uint32_t c2numpy_crc32c(uint32_t crc, const void *data, size_t size) {
+    return c2numpy_crc32c_portable(crc, (const char*)data, size);
+}
+#endif
+
+// a * b modulo the polynomial, in the reflected representation
+inline uint32_t c2numpy_crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = (uint32_t)1 << 31;  m != 0;  m >>= 1) {
+        if (a & m) product ^= b;
+        b = (b & 1) ? (b >> 1) ^ C2NUMPY_CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// The CRC32C of A followed by B, from their CRCs and B's size, without reading them again (as zlib's
+// crc32_combine): multiply crcA by x^(8*sizeB) one power of two at a time.
+inline uint32_t c2numpy_crc32c_combine(uint32_t crcA, uint32_t crcB, int64_t sizeB) {
+    uint32_t power = (uint32_t)1 << 23;   // x^8, the shift by one byte
+    for (;  sizeB > 0;  sizeB >>= 1) {
+        if (sizeB & 1)
+            crcA = c2numpy_crc32c_multiply(power, crcA);
+        power = c2numpy_crc32c_multiply(power, power);
+    }
+    return crcA ^ crcB;
+}
+
+#define C2NUMPY_BUFFER_FLUSH 65536
+
+// stage bytes in the writer's buffer; nothing reaches the sink until c2numpy_flush
+inline void c2numpy_put(c2numpy_writer *writer, const void *data, size_t size) {
+    if (writer->bufferUsed + size > writer->buffer.size())
+        writer->buffer.resize(2 * (writer->bufferUsed + size));
+    memcpy(&writer->buffer[writer->bufferUsed], data, size);
+    writer->bufferUsed += size;
+}
+
+// Add bytes that are leaving the buffer to the current file's checksums. The header is kept aside
+// instead, since c2numpy_finish may still patch its row count; blocks are counted from the start of
+// the file, so the block the header ends in is completed in c2numpy_checksum_file.
+void c2numpy_checksum_bytes(c2numpy_writer *writer, const char *data, size_t size) {
+    if (writer->fileBytes == 0) {
+        writer->checksumHeader.assign(data, writer->headerBytes);
+        data += writer->headerBytes;
+        size -= writer->headerBytes;
+    }
+    writer->checksum = c2numpy_crc32c(writer->checksum, data, size);
+    if (writer->checksumBlockSize == 0) {
+        writer->checksumBytes += size;
+        return;
+    }
+    while (size > 0) {
+        int64_t offset = writer->headerBytes + writer->checksumBytes;
+        size_t bytes = writer->checksumBlockSize - offset % writer->checksumBlockSize;
+        if (bytes > size) bytes = size;
+        writer->blockChecksum = c2numpy_crc32c(writer->blockChecksum, data, bytes);
+        writer->checksumBytes += bytes;
+        data += bytes;
+        size -= bytes;
+        if ((offset + (int64_t)bytes) % writer->checksumBlockSize == 0) {
+            writer->blockChecksums.push_back(writer->blockChecksum);
+            writer->blockChecksum = 0;
+        }
+    }
+}
+
+int c2numpy_flush(c2numpy_writer *writer) {
+    if (writer->bufferUsed == 0) return 0;
+    if (writer->checksums)
+        c2numpy_checksum_bytes(writer, &writer->buffer[0], writer->bufferUsed);
+    C2NUMPY_STATS_COUNT(writeCalls, 1)
+    C2NUMPY_STATS_COUNT(bytes, writer->bufferUsed)
+    int status = writer->sink.write(writer->sink.state, &writer->buffer[0], writer->bufferUsed);
+    writer->fileBytes += writer->bufferUsed;
+    writer->bufferUsed = 0;
+    return status;
+}
+
+inline void c2numpy_setnull(c2numpy_writer *writer, int32_t column, int64_t row) {
+    std::vector<uint8_t> &bits = writer->nulls[column];
+    if ((size_t)row / 8 >= bits.size())
+        bits.resize(2 * (row / 8 + 1), 0);
+    bits[row / 8] |= (uint8_t)(1 << (row % 8));
+    writer->nullCounts[column] += 1;
+}
+
+inline bool c2numpy_isnull(const c2numpy_writer *writer, int32_t column, size_t row) {
+    const std::vector<uint8_t> &bits = writer->nulls[column];
+    return row / 8 < bits.size()  &&  ((bits[row / 8] >> (row % 8)) & 1);
+}
+
+// Arrow-style validity bitmap (bit set if valid) of numRows rows of a column, starting at firstRow of
+// the current file; returns the number of nulls among them.
+int64_t c2numpy_validity(c2numpy_writer *writer, int32_t column, int64_t firstRow, int64_t numRows, uint8_t *valid) {
+    const std::vector<uint8_t> &bits = writer->nulls[column];
+    int64_t nullCount = 0;
+    memset(valid, 0, (numRows + 7) / 8);
+    for (int64_t row = 0;  row < numRows;  ++row) {
+        size_t inFile = firstRow + row;
+        if (inFile / 8 < bits.size()  &&  (bits[inFile / 8] >> (inFile % 8)) & 1)
+            nullCount += 1;
+        else
+            valid[row / 8] |= (uint8_t)(1 << (row % 8));
+    }
+    return nullCount;
+}
+
+//////////////////////////////////////////////////////////////// built-in sinks
+
+// stdio: one FILE per output file (the default)
+int c2numpy_stdio_open(void *state, const char *fileName) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->file = fopen(fileName, "wb");
+    return writer->file == NULL ? -1 : 0;
+}
+
+int c2numpy_stdio_write(void *state, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return fwrite(data, 1, size, writer->file) == size ? 0 : -1;
+}
+
+int c2numpy_stdio_patch(void *state, int64_t offset, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    if (fseek(writer->file, offset, SEEK_SET) != 0) return -1;
+    if (fwrite(data, 1, size, writer->file) != size) return -1;
+    return fseek(writer->file, 0, SEEK_END);
+}
+
+int c2numpy_stdio_close(void *state) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    int status = fclose(writer->file);
+    writer->file = NULL;
+    return status == 0 ? 0 : -1;
+}
+
+// fd: POSIX file descriptors with positional writes (no stdio buffering, since the writer buffers)
+inline int c2numpy_pwrite_all(int fd, const void *data, size_t size, int64_t offset) {
+    const char *bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written < 0) return -1;
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+int c2numpy_fd_open(void *state, const char *fileName) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return writer->fd < 0 ? -1 : 0;
+}
+
+int c2numpy_fd_write(void *state, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return c2numpy_pwrite_all(writer->fd, data, size, writer->fileBytes);
+}
+
+int c2numpy_fd_patch(void *state, int64_t offset, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return c2numpy_pwrite_all(writer->fd, data, size, offset);
+}
+
+int c2numpy_fd_close(void *state) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    int status = close(writer->fd);
+    writer->fd = -1;
+    return status;
+}
+
+// memory: each file is a std::string in writer->memoryFiles, named by writer->memoryNames
+int c2numpy_memory_open(void *state, const char *fileName) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->memoryNames.push_back(fileName);
+    writer->memoryFiles.push_back(std::string());
+    return 0;
+}
+
+int c2numpy_memory_write(void *state, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->memoryFiles.back().append((const char*)data, size);
+    return 0;
+}
+
+int c2numpy_memory_patch(void *state, int64_t offset, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->memoryFiles.back().replace(offset, size, (const char*)data, size);
+    return 0;
+}
+
+int c2numpy_memory_close(void * /* state */) {
+    return 0;
+}
+
+// callback: chunks are passed to writer->chunkFunction with their offsets
+int c2numpy_callback_open(void *state, const char *fileName) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    writer->chunkFileName = fileName;
+    return 0;
+}
+
+int c2numpy_callback_write(void *state, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return writer->chunkFunction(writer->chunkUserData, writer->chunkFileName.c_str(), writer->fileBytes, data, size);
+}
+
+int c2numpy_callback_patch(void *state, int64_t offset, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return writer->chunkFunction(writer->chunkUserData, writer->chunkFileName.c_str(), offset, data, size);
+}
+
+int c2numpy_callback_close(void *state) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    return writer->chunkFunction(writer->chunkUserData, writer->chunkFileName.c_str(), writer->fileBytes, NULL, 0);
+}
+
+// stream: every file is written whole to one fd (pipe, socket, ...) as a complete .npy with its
+// exact row count, so the stream is a sequence of self-delimiting arrays of at most numRowsPerFile rows
+int c2numpy_stream_open(void * /* state */, const char * /* fileName */) {
+    return 0;
+}
+
+int c2numpy_stream_write(void *state, const void *data, size_t size) {
+    c2numpy_writer *writer = (c2numpy_writer*)state;
+    const char *bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(writer->fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int c2numpy_stream_close(void * /* state */) {
+    return 0;   // the fd belongs to the caller
+}
+
+int c2numpy_use_sink(c2numpy_writer *writer, c2numpy_sink sink) {
+    if (writer->fileOpen) return -1;   // too late: a file is being written
+    writer->sink = sink;
+    return 0;
+}
+
+int c2numpy_use_stdio(c2numpy_writer *writer) {
+    c2numpy_sink sink = {c2numpy_stdio_open, c2numpy_stdio_write, c2numpy_stdio_patch, c2numpy_stdio_close, writer};
+    return c2numpy_use_sink(writer, sink);
+}
+
+int c2numpy_use_fd(c2numpy_writer *writer) {
+    c2numpy_sink sink = {c2numpy_fd_open, c2numpy_fd_write, c2numpy_fd_patch, c2numpy_fd_close, writer};
+    return c2numpy_use_sink(writer, sink);
+}
+
+int c2numpy_use_memory(c2numpy_writer *writer) {
+    c2numpy_sink sink = {c2numpy_memory_open, c2numpy_memory_write, c2numpy_memory_patch, c2numpy_memory_close, writer};
+    return c2numpy_use_sink(writer, sink);
+}
+
+int c2numpy_use_callback(c2numpy_writer *writer, c2numpy_chunk_function function, void *userData) {
+    if (function == NULL) return -1;
+    c2numpy_sink sink = {c2numpy_callback_open, c2numpy_callback_write, c2numpy_callback_patch, c2numpy_callback_close, writer};
+    if (c2numpy_use_sink(writer, sink) != 0) return -1;
+    writer->chunkFunction = function;
+    writer->chunkUserData = userData;
+    return 0;
+}
+
+// A stream has no sidecar files, so it can't carry what some columns need to be read back: category
+// strings, how to undo a transform, and nulls in .npy (Arrow has its own validity buffers).
+inline int c2numpy_stream_carries(c2numpy_writer *writer, int arrowIPC) {
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        if (writer->columnTypes[column] == C2NUMPY_CATEGORY  ||  writer->transforms[column].kind != C2NUMPY_NO_TRANSFORM) return 0;
+        if (!arrowIPC  &&  writer->nullCounts[column] >= 0) return 0;
+    }
+    return 1;
+}
+
+int c2numpy_use_stream(c2numpy_writer *writer, int fd) {
+    if (!c2numpy_stream_carries(writer, 1)) return -1;   // nulls are checked again at c2numpy_open
+    c2numpy_sink sink = {c2numpy_stream_open, c2numpy_stream_write, NULL, c2numpy_stream_close, writer};
+    if (c2numpy_use_sink(writer, sink) != 0) return -1;
+    writer->fd = fd;
+    return 0;
+}
+
 const char *c2numpy_descr(c2numpy_type type) {
     // FIXME: all of the "<" signs should be system-dependent (they mean little endian)
     static const char *c2numpy_bool = "|b1";
@@ -89,6 +622,7 @@ const char *c2numpy_descr(c2numpy_type type) {
     static const char *c2numpy_complex = "<c16";
     static const char *c2numpy_complex64 = "<c8";
     static const char *c2numpy_complex128 = "<c16";
+    static const char *c2numpy_category = "<i4";
 
     static const char *c2numpy_str[155] = {"|S0", "|S1", "|S2", "|S3", "|S4", "|S5", "|S6", "|S7", "|S8", "|S9", "|S10", "|S11", "|S12", "|S13", "|S14", "|S15", "|S16", "|S17", "|S18", "|S19", "|S20", "|S21", "|S22", "|S23", "|S24", "|S25", "|S26", "|S27", "|S28", "|S29", "|S30", "|S31", "|S32", "|S33", "|S34", "|S35", "|S36", "|S37", "|S38", "|S39", "|S40", "|S41", "|S42", "|S43", "|S44", "|S45", "|S46", "|S47", "|S48", "|S49", "|S50", "|S51", "|S52", "|S53", "|S54", "|S55", "|S56", "|S57", "|S58", "|S59", "|S60", "|S61", "|S62", "|S63", "|S64", "|S65", "|S66", "|S67", "|S68", "|S69", "|S70", "|S71", "|S72", "|S73", "|S74", "|S75", "|S76", "|S77", "|S78", "|S79", "|S80", "|S81", "|S82", "|S83", "|S84", "|S85", "|S86", "|S87", "|S88", "|S89", "|S90", "|S91", "|S92", "|S93", "|S94", "|S95", "|S96", "|S97", "|S98", "|S99", "|S100", "|S101", "|S102", "|S103", "|S104", "|S105", "|S106", "|S107", "|S108", "|S109", "|S110", "|S111", "|S112", "|S113", "|S114", "|S115", "|S116", "|S117", "|S118", "|S119", "|S120", "|S121", "|S122", "|S123", "|S124", "|S125", "|S126", "|S127", "|S128", "|S129", "|S130", "|S131", "|S132", "|S133", "|S134", "|S135", "|S136", "|S137", "|S138", "|S139", "|S140", "|S141", "|S142", "|S143", "|S144", "|S145", "|S146", "|S147", "|S148", "|S149", "|S150", "|S151", "|S152", "|S153", "|S154"};
 
@@ -131,6 +665,8 @@ const char *c2numpy_descr(c2numpy_type type) {
           return c2numpy_complex64;
       case C2NUMPY_COMPLEX128:
           return c2numpy_complex128;
+      case C2NUMPY_CATEGORY:
+          return c2numpy_category;
       default:
           if (0 < type - C2NUMPY_STRING  &&  type - C2NUMPY_STRING < 155)
               return c2numpy_str[type - C2NUMPY_STRING];
@@ -139,48 +675,776 @@ const char *c2numpy_descr(c2numpy_type type) {
     return NULL;
 }
 
+//////////////////////////////////////////////////////////////// Arrow IPC files
+
+// Arrow format of a Numpy descr: "" if there's no equivalent, or "+w:2" with itemFormat for complex numbers,
+// which Arrow represents as fixed-size lists of two floats
+std::string c2numpy_arrow_format(const char *descr, std::string &itemFormat) {
+    int size = atoi(descr + 2);
+    itemFormat = "";
+    switch (descr[1]) {
+      case 'b':
+          return "b";
+      case 'i':
+          return size == 1 ? "c" : size == 2 ? "s" : size == 4 ? "i" : "l";
+      case 'u':
+          return size == 1 ? "C" : size == 2 ? "S" : size == 4 ? "I" : "L";
+      case 'f':
+          return size == 2 ? "e" : size == 4 ? "f" : "g";
+      case 'c':
+          itemFormat = size == 8 ? "f" : "g";
+          return "+w:2";
+      case 'S': {
+          std::stringstream format;
+          format << "w:" << size;
+          return format.str();
+      }
+    }
+    return "";
+}
+
+// Just enough of a FlatBuffers builder for Arrow's metadata. Like the reference implementation, it
+// builds back to front, so everything an offset points to is already built; positions are measured
+// from the end of the buffer.
+class c2numpy_flatbuffer {
+public:
+    c2numpy_flatbuffer(): minAlign(1) { }
+
+    inline uint32_t size() { return bytes.size(); }
+
+    template <typename T> uint32_t scalar(T value) {
+        prep(sizeof(T), 0);
+        prepend(&value, sizeof(T));
+        return size();
+    }
+
+    uint32_t offset(uint32_t target) {
+        prep(4, 0);
+        uint32_t value = size() + 4 - target;
+        prepend(&value, 4);
+        return size();
+    }
+
+    uint32_t string(const std::string &value) {
+        prep(4, value.size() + 1);
+        prepend("", 1);
+        prepend(value.data(), value.size());
+        return scalar((uint32_t)value.size());
+    }
+
+    uint32_t offsets(const std::vector<uint32_t> &targets) {
+        prep(4, 4 * targets.size());
+        for (size_t i = targets.size();  i > 0;  --i)
+            offset(targets[i - 1]);
+        return scalar((uint32_t)targets.size());
+    }
+
+    // a vector of structs, already laid out in data
+    uint32_t structs(const void *data, size_t count, size_t structSize, size_t alignment) {
+        prep(4, count * structSize);
+        prep(alignment, count * structSize);
+        prepend(data, count * structSize);
+        return scalar((uint32_t)count);
+    }
+
+    // build a table's fields (children first, then start, field..., end)
+    inline void start() {
+        fields.clear();
+        tableStart = size();
+    }
+
+    template <typename T> void field(uint16_t slot, T value) {
+        fields.push_back(std::make_pair(slot, scalar(value)));
+    }
+
+    void fieldoffset(uint16_t slot, uint32_t target) {
+        fields.push_back(std::make_pair(slot, offset(target)));
+    }
+
+    uint32_t end() {
+        uint32_t table = scalar((int32_t)0);   // replaced by the distance to the vtable
+
+        uint16_t numSlots = 0;
+        for (size_t i = 0;  i < fields.size();  ++i)
+            numSlots = std::max(numSlots, (uint16_t)(fields[i].first + 1));
+        std::vector<uint16_t> vtable(2 + numSlots, 0);
+        vtable[0] = 2 * vtable.size();
+        vtable[1] = table - tableStart;
+        for (size_t i = 0;  i < fields.size();  ++i)
+            vtable[2 + fields[i].first] = table - fields[i].second;
+        prepend(&vtable[0], 2 * vtable.size());
+
+        int32_t distance = size() - table;
+        memcpy(&bytes[bytes.size() - table], &distance, 4);
+        return table;
+    }
+
+    std::string finish(uint32_t root) {
+        prep(minAlign, 4);
+        offset(root);
+        return bytes;
+    }
+
+private:
+    // pad so that after "additional" more bytes, the size is a multiple of alignment
+    void prep(size_t alignment, size_t additional) {
+        if (alignment > minAlign) minAlign = alignment;
+        size_t padding = (alignment - (bytes.size() + additional) % alignment) % alignment;
+        bytes.insert(0, padding, '\0');
+    }
+
+    inline void prepend(const void *data, size_t size) {
+        if (size > 0)
+            bytes.insert(0, (const char*)data, size);
+    }
+
+    std::string bytes;
+    size_t minAlign;
+    uint32_t tableStart;
+    std::vector<std::pair<uint16_t, uint32_t> > fields;
+};
+
+// https://arrow.apache.org/docs/format/Columnar.html#serialization-and-interprocess-communication-ipc
+#define C2NUMPY_ARROW_METADATA_V5 4
+#define C2NUMPY_ARROW_INT 2
+#define C2NUMPY_ARROW_FLOATINGPOINT 3
+#define C2NUMPY_ARROW_BOOL 6
+#define C2NUMPY_ARROW_FIXEDSIZEBINARY 15
+#define C2NUMPY_ARROW_FIXEDSIZELIST 16
+#define C2NUMPY_ARROW_SCHEMA 1
+#define C2NUMPY_ARROW_RECORDBATCH 3
+
+uint32_t c2numpy_arrow_field(c2numpy_flatbuffer &fb, const std::string &name, const std::string &format, const std::string &itemFormat, uint8_t nullable) {
+    std::vector<uint32_t> children;
+    if (itemFormat != "")
+        children.push_back(c2numpy_arrow_field(fb, "item", itemFormat, "", 0));
+    uint32_t childVector = fb.offsets(children);
+    uint32_t nameString = fb.string(name);
+
+    uint8_t typeType;
+    fb.start();
+    switch (format[0]) {
+      case 'b':
+          typeType = C2NUMPY_ARROW_BOOL;
+          break;
+      case 'e': case 'f': case 'g':
+          typeType = C2NUMPY_ARROW_FLOATINGPOINT;
+          fb.field(0, (int16_t)(format[0] == 'e' ? 0 : format[0] == 'f' ? 1 : 2));   // precision
+          break;
+      case 'w':
+          typeType = C2NUMPY_ARROW_FIXEDSIZEBINARY;
+          fb.field(0, (int32_t)atoi(format.c_str() + 2));   // byteWidth
+          break;
+      case '+':
+          typeType = C2NUMPY_ARROW_FIXEDSIZELIST;
+          fb.field(0, (int32_t)atoi(format.c_str() + 3));   // listSize
+          break;
+      default: {   // integers: c, s, i, l signed and C, S, I, L unsigned
+          typeType = C2NUMPY_ARROW_INT;
+          char lower = tolower(format[0]);
+          fb.field(0, (int32_t)(lower == 'c' ? 8 : lower == 's' ? 16 : lower == 'i' ? 32 : 64));   // bitWidth
+          fb.field(1, (uint8_t)(format[0] == lower));                                           // is_signed
+      }
+    }
+    uint32_t type = fb.end();
+
+    fb.start();
+    fb.fieldoffset(0, nameString);
+    fb.field(1, nullable);
+    fb.field(2, typeType);
+    fb.fieldoffset(3, type);
+    fb.fieldoffset(5, childVector);
+    return fb.end();
+}
+
+uint32_t c2numpy_arrow_schema(c2numpy_flatbuffer &fb, c2numpy_writer *writer) {
+    std::vector<uint32_t> fields;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        std::string itemFormat;
+        std::string format = c2numpy_arrow_format(c2numpy_descr(writer->columnTypes[column]), itemFormat);
+        fields.push_back(c2numpy_arrow_field(fb, writer->columnNames[column], format, itemFormat, writer->nullCounts[column] >= 0));
+    }
+    uint32_t fieldVector = fb.offsets(fields);
+    fb.start();
+    fb.field(0, (int16_t)0);           // little endian
+    fb.fieldoffset(1, fieldVector);
+    return fb.end();
+}
+
+// an encapsulated message: continuation marker, metadata size, metadata padded to 8 bytes
+std::string c2numpy_arrow_message(c2numpy_flatbuffer &fb, uint8_t headerType, uint32_t header, int64_t bodyLength) {
+    fb.start();
+    fb.field(3, bodyLength);
+    fb.field(0, (int16_t)C2NUMPY_ARROW_METADATA_V5);
+    fb.field(1, headerType);
+    fb.fieldoffset(2, header);
+    std::string metadata = fb.finish(fb.end());
+    metadata.resize((metadata.size() + 7) / 8 * 8, '\0');
+
+    int32_t prefix[2] = {-1, (int32_t)metadata.size()};
+    return std::string((const char*)prefix, 8) + metadata;
+}
+
+// Turn the rows of a file into one record batch: the message followed by its body, with each column
+// in its own buffers (the validity buffer is empty unless the column has nulls).
+std::string c2numpy_arrow_batch(c2numpy_writer *writer, const char *rows, int64_t numRows, int64_t &metadataBytes) {
+    struct Node { int64_t length; int64_t nullCount; };
+    struct Buffer { int64_t offset; int64_t length; };
+    std::vector<Node> nodes;
+    std::vector<Buffer> buffers;
+    std::string body;
+
+    size_t rowSize = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        rowSize += atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
+
+    size_t offset = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        size_t itemSize = atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
+        std::string itemFormat;
+        std::string format = c2numpy_arrow_format(c2numpy_descr(writer->columnTypes[column]), itemFormat);
+
+        Node node = {numRows, 0};
+        Buffer validity = {(int64_t)body.size(), 0};
+        if (writer->nullCounts[column] > 0) {
+            validity.length = (numRows + 7) / 8;
+            body.resize(body.size() + validity.length);
+            node.nullCount = c2numpy_validity(writer, column, 0, numRows, (uint8_t*)&body[validity.offset]);
+            body.resize((body.size() + 7) / 8 * 8, '\0');
+        }
+        nodes.push_back(node);
+        buffers.push_back(validity);
+        if (itemFormat != "") {   // complex: the floats are the list's child
+            Node child = {2 * numRows, 0};
+            Buffer none = {(int64_t)body.size(), 0};
+            nodes.push_back(child);
+            buffers.push_back(none);
+        }
+
+        Buffer values = {(int64_t)body.size(), 0};
+        if (format == "b") {
+            // Arrow booleans are bits
+            values.length = (numRows + 7) / 8;
+            body.resize(body.size() + values.length, '\0');
+            for (int64_t row = 0;  row < numRows;  ++row)
+                if (rows[row * rowSize + offset])
+                    body[values.offset + row / 8] |= (char)(1 << (row % 8));
+        }
+        else {
+            values.length = numRows * itemSize;
+            body.resize(body.size() + values.length);
+            for (int64_t row = 0;  row < numRows;  ++row)
+                memcpy(&body[values.offset + row * itemSize], &rows[row * rowSize + offset], itemSize);
+        }
+        buffers.push_back(values);
+        body.resize((body.size() + 7) / 8 * 8, '\0');
+        offset += itemSize;
+    }
+
+    c2numpy_flatbuffer fb;
+    uint32_t bufferVector = fb.structs(buffers.empty() ? NULL : &buffers[0], buffers.size(), sizeof(Buffer), 8);
+    uint32_t nodeVector = fb.structs(nodes.empty() ? NULL : &nodes[0], nodes.size(), sizeof(Node), 8);
+    fb.start();
+    fb.field(0, numRows);
+    fb.fieldoffset(1, nodeVector);
+    fb.fieldoffset(2, bufferVector);
+    std::string message = c2numpy_arrow_message(fb, C2NUMPY_ARROW_RECORDBATCH, fb.end(), body.size());
+
+    metadataBytes = message.size();
+    return message + body;
+}
+
+std::string c2numpy_arrow_schema_message(c2numpy_writer *writer) {
+    c2numpy_flatbuffer fb;
+    uint32_t schema = c2numpy_arrow_schema(fb, writer);
+    return c2numpy_arrow_message(fb, C2NUMPY_ARROW_SCHEMA, schema, 0);
+}
+
+// The whole of one output file: an Arrow IPC file (Feather v2) with one record batch, or for a stream
+// sink, the next record batch of one IPC stream (after the schema, if it's the first).
+std::string c2numpy_arrow_ipc_file(c2numpy_writer *writer, const char *rows, int64_t numRows) {
+    static const char end[8] = {'\xff', '\xff', '\xff', '\xff', 0, 0, 0, 0};
+    int64_t metadataBytes;
+    std::string batch = c2numpy_arrow_batch(writer, rows, numRows, metadataBytes);
+
+    if (writer->sink.open == c2numpy_stream_open) {
+        if (writer->currentFileNumber == 0)
+            return c2numpy_arrow_schema_message(writer) + batch;
+        return batch;
+    }
+
+    std::string out("ARROW1\0\0", 8);
+    out += c2numpy_arrow_schema_message(writer);
+    struct Block { int64_t offset; int32_t metaDataLength; int32_t padding; int64_t bodyLength; };
+    Block block = {(int64_t)out.size(), (int32_t)metadataBytes, 0, (int64_t)(batch.size() - metadataBytes)};
+    out += batch;
+    out += std::string(end, 8);
+
+    // the footer repeats the schema and says where the record batch is
+    c2numpy_flatbuffer fb;
+    uint32_t schema = c2numpy_arrow_schema(fb, writer);
+    uint32_t blockVector = fb.structs(&block, 1, sizeof(Block), 8);
+    uint32_t dictionaryVector = fb.structs(NULL, 0, sizeof(Block), 8);
+    fb.start();
+    fb.field(0, (int16_t)C2NUMPY_ARROW_METADATA_V5);
+    fb.fieldoffset(1, schema);
+    fb.fieldoffset(2, dictionaryVector);
+    fb.fieldoffset(3, blockVector);
+    std::string footer = fb.finish(fb.end());
+    int32_t footerSize = footer.size();
+
+    out += footer;
+    out += std::string((const char*)&footerSize, 4);
+    out += "ARROW1";
+    return out;
+}
+
 int c2numpy_init(c2numpy_writer *writer, const std::string outputFilePrefix, int32_t numRowsPerFile) {
     writer->file = NULL;
+    writer->fd = -1;
+    writer->chunkFunction = NULL;
+    writer->chunkUserData = NULL;
+    writer->fileOpen = 0;
+    c2numpy_use_stdio(writer);
+
     writer->outputFilePrefix = outputFilePrefix;
+    writer->fileBytes = 0;
+    writer->bufferUsed = 0;
+    writer->bufferFlush = C2NUMPY_BUFFER_FLUSH;
+    writer->buffer.resize(2 * C2NUMPY_BUFFER_FLUSH);
     writer->sizeSeekPosition = 0;
     writer->sizeSeekSize = 0;
 
-    writer->numColumns = 0;
+    writer->numColumns = 0;
+    writer->matrix = 0;
+    writer->fortranOrder = 0;
+    writer->arrowIPC = 0;
+
+    writer->numRowsPerFile = numRowsPerFile;
+    writer->currentColumn = 0;
+    writer->currentRowInFile = 0;
+    writer->currentFileNumber = 0;
+    writer->rowsFinished = 0;
+    writer->rowStage = 0;
+    writer->rowSize = 0;
+    writer->prescaleColumn = -1;
+    writer->prescaleFraction = 1.0;
+    writer->prescaleOffset = 0;
+    writer->prescaleSize = 0;
+    writer->sampleSize = 0;
+    writer->sampleSeen = 0;
+    writer->sampleState = 0;
+    writer->summarizedRows = 0;
+    writer->checksums = 0;
+    writer->checksumBlockSize = 0;
+    writer->checksum = 0;
+    writer->checksumBytes = 0;
+    writer->blockChecksum = 0;
+
+#ifdef C2NUMPY_STATS
+    memset(&writer->stats, 0, sizeof(c2numpy_stats));
+    writer->statsFunction = NULL;
+    writer->statsUserData = NULL;
+    writer->statsEveryRows = 0;
+#endif
+
+    return 0;
+}
+
+int c2numpy_addcolumn(c2numpy_writer *writer, const std::string name, c2numpy_type type) {
+    if (type == C2NUMPY_CATEGORY  &&  writer->sink.open == c2numpy_stream_open) return -1;   // no dictionary in a stream
+    writer->numColumns += 1;
+    writer->columnNames.push_back(name);
+    writer->columnTypes.push_back(type);
+    writer->categories.push_back(std::vector<std::string>());
+    writer->categoryCodes.push_back(std::unordered_map<std::string, int32_t>());
+    writer->categoriesWritten.push_back(-1);
+    c2numpy_transform none = {C2NUMPY_NO_TRANSFORM, type, 1.0, 0.0, 52};
+    writer->transforms.push_back(none);
+    writer->flagNames.push_back(std::vector<std::string>());
+    writer->nullCounts.push_back(-1);
+    writer->nulls.push_back(std::vector<uint8_t>());
+    return 0;
+}
+
+// A column of up to 64 named flags packed into the smallest unsigned integer that holds them, set
+// with c2numpy_flags. The names go to <prefix><name>.flags.txt, one per line, bit 0 first.
+int c2numpy_addflags(c2numpy_writer *writer, const std::string name, const std::vector<std::string> &bits) {
+    if (bits.empty()  ||  bits.size() > 64) return -1;
+    c2numpy_type type = bits.size() <= 8 ? C2NUMPY_UINT8 : bits.size() <= 16 ? C2NUMPY_UINT16 : bits.size() <= 32 ? C2NUMPY_UINT32 : C2NUMPY_UINT64;
+    c2numpy_addcolumn(writer, name, type);
+    writer->flagNames.back() = bits;
+    return 0;
+}
+
+inline uint16_t c2numpy_float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000)                      // inf or nan
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    if (magnitude >= 0x477ff000)                      // rounds to more than 65504
+        return sign | 0x7c00;
+    if (magnitude < 0x38800000) {                     // subnormal in half precision: units of 2**-24
+        float small;
+        memcpy(&small, &magnitude, 4);
+        return sign | (uint16_t)lrintf(small * 16777216.0f);
+    }
+    uint32_t half = ((magnitude >> 23) - 127 + 15) << 10 | ((magnitude >> 13) & 0x3ff);
+    uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000  ||  (rest == 0x1000  &&  (half & 1)))   // to nearest, ties to even
+        half += 1;
+    return sign | half;
+}
+
+// n items: doubles in, items of the stored type out; one loop per kind, so that the compiler can vectorize
+void c2numpy_transform_items(const c2numpy_transform &transform, c2numpy_type stored, const double *in, char *out, int64_t n) {
+    switch (transform.kind) {
+      case C2NUMPY_DOWNCAST:
+          if (stored == C2NUMPY_FLOAT32)
+              for (int64_t i = 0;  i < n;  ++i) {
+                  float value = in[i];
+                  memcpy(out + 4*i, &value, 4);
+              }
+          else
+              for (int64_t i = 0;  i < n;  ++i) {
+                  uint16_t value = c2numpy_float_to_half(in[i]);
+                  memcpy(out + 2*i, &value, 2);
+              }
+          break;
+
+      case C2NUMPY_QUANTIZE: {
+          int size = atoi(c2numpy_descr(stored) + 2);
+          double low = -ldexp(1.0, 8*size - 1);
+          double high = ldexp(1.0, 8*size - 1) - 1;
+          for (int64_t i = 0;  i < n;  ++i) {
+              double value = nearbyint((in[i] - transform.offset) / transform.scale);
+              value = value < low ? low : value > high ? high : value;
+              int32_t code = value == value ? (int32_t)value : 0;   // nan becomes 0
+              memcpy(out + size*i, &code, size);   // little-endian: the low bytes
+          }
+          break;
+      }
+
+      case C2NUMPY_TRUNCATE: {
+          int drop = 52 - transform.mantissaBits;
+          uint64_t keep = ~(((uint64_t)1 << drop) - 1);
+          uint64_t half = drop > 0 ? (uint64_t)1 << (drop - 1) : 0;
+          for (int64_t i = 0;  i < n;  ++i) {
+              uint64_t bits;
+              memcpy(&bits, &in[i], 8);
+              if ((bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL)   // leave inf and nan alone
+                  bits = (bits + half) & keep;
+              memcpy(out + 8*i, &bits, 8);
+          }
+          break;
+      }
+
+      default:
+          memcpy(out, in, 8*n);
+    }
+}
+
+inline int c2numpy_settransform(c2numpy_writer *writer, const std::string &name, c2numpy_transform transform, c2numpy_type stored) {
+    if (writer->fileOpen  ||  writer->sink.open == c2numpy_stream_open) return -1;   // no transforms.txt in a stream
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->columnNames[column] == name) {
+            c2numpy_type declared = writer->columnTypes[column];
+            if (writer->transforms[column].kind != C2NUMPY_NO_TRANSFORM) return -1;
+            if (declared != C2NUMPY_FLOAT64  &&  declared != C2NUMPY_FLOAT) return -1;
+            transform.declared = declared;
+            writer->transforms[column] = transform;
+            writer->columnTypes[column] = stored == C2NUMPY_FLOAT64 ? declared : stored;
+            return 0;
+        }
+    return -1;
+}
+
+// store a float64 column as float32 or float16
+int c2numpy_downcast(c2numpy_writer *writer, const std::string &name, c2numpy_type type) {
+    if (type != C2NUMPY_FLOAT32  &&  type != C2NUMPY_FLOAT16) return -1;
+    c2numpy_transform transform = {C2NUMPY_DOWNCAST, type, 1.0, 0.0, 52};
+    return c2numpy_settransform(writer, name, transform, type);
+}
+
+// store a float64 column as fixed-point int8, int16 or int32: value = offset + scale * code
+int c2numpy_quantize(c2numpy_writer *writer, const std::string &name, c2numpy_type type, double scale, double offset) {
+    if ((type != C2NUMPY_INT8  &&  type != C2NUMPY_INT16  &&  type != C2NUMPY_INT32)  ||  !(scale != 0.0)) return -1;
+    c2numpy_transform transform = {C2NUMPY_QUANTIZE, type, scale, offset, 52};
+    return c2numpy_settransform(writer, name, transform, type);
+}
+
+// keep a float64 column as float64, but round its mantissa to mantissaBits (of 52), so that it compresses
+int c2numpy_truncate(c2numpy_writer *writer, const std::string &name, int mantissaBits) {
+    if (mantissaBits < 0  ||  mantissaBits > 52) return -1;
+    c2numpy_transform transform = {C2NUMPY_TRUNCATE, C2NUMPY_FLOAT64, 1.0, 0.0, mantissaBits};
+    return c2numpy_settransform(writer, name, transform, C2NUMPY_FLOAT64);
+}
+
+// booleans, integers, float32 and float64: the types that c2numpy_sortby and c2numpy_summarize can read
+inline int c2numpy_numeric(c2numpy_type type) {
+    char kind = c2numpy_descr(type)[1];
+    return (kind == 'b'  ||  kind == 'i'  ||  kind == 'u'  ||  kind == 'f')  &&  type != C2NUMPY_FLOAT16;
+}
+
+// Sort the rows of each file by the given columns (the first is the most significant) before writing
+// it. Keys can be booleans, integers (including categories and flags) or float32/float64. Each file is
+// then held in memory until it's finished, and its range of each key is added to <prefix>keyranges.txt.
+int c2numpy_sortby(c2numpy_writer *writer, const std::vector<std::string> &keys) {
+    if (writer->fileOpen  ||  keys.empty()  ||  !writer->groupKeys.empty()) return -1;
+    std::vector<int32_t> columns;
+    std::string header = "number";
+    for (size_t i = 0;  i < keys.size();  ++i) {
+        int32_t column = 0;
+        while (column < writer->numColumns  &&  writer->columnNames[column] != keys[i]) ++column;
+        if (column == writer->numColumns  ||  !c2numpy_numeric(writer->columnTypes[column])) return -1;
+        columns.push_back(column);
+        header += " " + keys[i] + "_min " + keys[i] + "_max";
+    }
+    writer->sortKeys = columns;
+    writer->keyRanges = header + "\n";
+    return 0;
+}
+
+// Name the keys of the groups of consecutive rows that c2numpy_begin_group starts (such as run, lumi,
+// event). The groups go to <prefix>groups.npy at c2numpy_close, sorted by key. Not with c2numpy_sortby or
+// c2numpy_sample, which would scatter them.
+int c2numpy_groupby(c2numpy_writer *writer, const std::vector<std::string> &keys) {
+    if (writer->fileOpen  ||  keys.empty()  ||  !writer->sortKeys.empty()  ||  writer->sampleSize > 0) return -1;
+    writer->groupKeys = keys;
+    return 0;
+}
+
+// the next row starts a group with these keys, which lasts until the next group starts
+int c2numpy_begin_group(c2numpy_writer *writer, const std::vector<int64_t> &key) {
+    if (writer->currentColumn != 0  ||  key.size() != writer->groupKeys.size()  ||  key.empty()) return -1;
+    writer->groups.insert(writer->groups.end(), key.begin(), key.end());
+    writer->groups.push_back(writer->currentFileNumber);
+    writer->groups.push_back(writer->currentRowInFile);
+    writer->groups.push_back(writer->rowsFinished + writer->currentRowInFile);
+    return 0;
+}
+
+// byte offset of a column in a row, for c2numpy_filter functions; -1 if there is no such column
+int64_t c2numpy_offset(c2numpy_writer *writer, const std::string &name) {
+    int64_t offset = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        if (writer->columnNames[column] == name) return offset;
+        offset += atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
+    }
+    return -1;
+}
+
+// Write only the rows that function accepts. It sees each row as it will be stored: transformed,
+// categories as codes, and zeros for nulls. With several filters, a row has to pass all of them.
+int c2numpy_filter(c2numpy_writer *writer, c2numpy_filter_function function, void *userData) {
+    if (writer->fileOpen  ||  function == NULL) return -1;
+    writer->filters.push_back(function);
+    writer->filterUserData.push_back(userData);
+    writer->rowStage = 1;
+    return 0;
+}
+
+// Write a fraction of the rows, chosen by a hash of an integer column (such as the event number), so
+// that the same rows are kept in every run and all rows with the same value are kept or dropped together.
+int c2numpy_prescale(c2numpy_writer *writer, const std::string &name, double fraction) {
+    if (writer->fileOpen  ||  fraction < 0.0) return -1;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->columnNames[column] == name) {
+            char kind = c2numpy_descr(writer->columnTypes[column])[1];
+            if (kind != 'b'  &&  kind != 'i'  &&  kind != 'u') return -1;
+            writer->prescaleColumn = column;
+            writer->prescaleFraction = fraction;
+            writer->rowStage = 1;
+            return 0;
+        }
+    return -1;
+}
+
+// Write a uniform random sample of sampleSize rows from each numRowsPerFile rows (after the filters and
+// prescale), by reservoir sampling in the held file; seed makes it repeatable. Rows lose their order.
+int c2numpy_sample(c2numpy_writer *writer, int32_t sampleSize, uint64_t seed) {
+    if (writer->fileOpen  ||  sampleSize <= 0  ||  !writer->groupKeys.empty()) return -1;
+    writer->sampleSize = sampleSize;
+    writer->sampleState = seed;
+    writer->rowStage = 1;
+    return 0;
+}
+
+// Keep count, mean, variance, min and max of a numeric column, and a histogram if numBins > 0, as it's
+// written; c2numpy_finish writes them for each file to <prefix><number>.summary.json and c2numpy_close for
+// all files to <prefix>summary.json. They're of the values as stored (but unquantized), without nulls or nan.
+int c2numpy_summarize(c2numpy_writer *writer, const std::string &name, int32_t numBins = 0, double low = 0.0, double high = 0.0) {
+    if (writer->fileOpen  ||  numBins < 0  ||  (numBins > 0  &&  !(low < high))) return -1;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->columnNames[column] == name) {
+            if (!c2numpy_numeric(writer->columnTypes[column])) return -1;
+            c2numpy_summary summary = {column, 0, 0, 0, 0.0, 0.0, INFINITY, -INFINITY, low, high, std::vector<int64_t>()};
+            if (numBins > 0)
+                summary.bins.resize(numBins + 2, 0);
+            writer->fileSummaries.push_back(summary);
+            writer->runSummaries.push_back(summary);
+            return 0;
+        }
+    return -1;
+}
+
+// Compute the CRC32C of each file as it's written, and of each blockSize bytes of it if blockSize > 0,
+// for <prefix>checksums.txt at c2numpy_close (checked by c2numpy-verify).
+int c2numpy_checksums(c2numpy_writer *writer, int64_t blockSize = 0) {
+    if (writer->fileOpen  ||  blockSize < 0) return -1;
+    writer->checksums = 1;
+    writer->checksumBlockSize = blockSize;
+    return 0;
+}
+
+// let a column hold nulls (c2numpy_null), before the first file is opened
+int c2numpy_nullable(c2numpy_writer *writer, const std::string &name) {
+    if (writer->fileOpen) return -1;
+    if (writer->sink.open == c2numpy_stream_open  &&  !writer->arrowIPC) return -1;   // no .valid.npy in a stream
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->columnNames[column] == name) {
+            writer->nullCounts[column] = 0;
+            return 0;
+        }
+    return -1;
+}
+
+// small auxiliary file next to the data files, written through the sink (but not into a stream)
+int c2numpy_sidecar(c2numpy_writer *writer, const std::string &suffix, const std::string &contents) {
+    if (writer->fileOpen) return -1;
+    if (writer->sink.open == c2numpy_stream_open) return 0;
 
-    writer->numRowsPerFile = numRowsPerFile;
-    writer->currentColumn = 0;
-    writer->currentRowInFile = 0;
-    writer->currentFileNumber = 0;
+    std::string fileName = writer->outputFilePrefix + suffix;
+    int status = writer->sink.open(writer->sink.state, fileName.c_str());
+    if (status != 0) return -1;
+    writer->fileBytes = 0;   // the fd sink writes at this offset
+    C2NUMPY_STATS_COUNT(writeCalls, 1)
+    C2NUMPY_STATS_COUNT(bytes, contents.size())
+    status |= writer->sink.write(writer->sink.state, contents.data(), contents.size());
+    writer->fileBytes = contents.size();   // the callback sink reports the size at close
+    status |= writer->sink.close(writer->sink.state);
+    return status == 0 ? 0 : -1;
+}
 
+int c2numpy_matrix(c2numpy_writer *writer, int fortranOrder) {
+    if (writer->fileOpen) return -1;
+    writer->matrix = 1;
+    writer->fortranOrder = fortranOrder;
     return 0;
 }
 
-int c2numpy_addcolumn(c2numpy_writer *writer, const std::string name, c2numpy_type type) {
-    writer->numColumns += 1;
-    writer->columnNames.push_back(name);
-    writer->columnTypes.push_back(type);
+// Arrow's columnar format instead of .npy, for Arrow tools (pyarrow.feather.read_table, ...): each
+// output file is an Arrow IPC file with one record batch, or with c2numpy_use_stream, the stream is one
+// Arrow IPC stream with a record batch per numRowsPerFile rows. Not for matrix output.
+int c2numpy_arrow_ipc(c2numpy_writer *writer) {
+    if (writer->fileOpen  ||  writer->matrix) return -1;
+    writer->arrowIPC = 1;
     return 0;
 }
 
 int c2numpy_open(c2numpy_writer *writer) {
+    C2NUMPY_STATS_BEGIN(openStart)
+    if (writer->matrix  &&  writer->arrowIPC) return -1;
+    if (writer->sink.open == c2numpy_stream_open  &&  !c2numpy_stream_carries(writer, writer->arrowIPC)) return -1;
+
+    // a transform set after c2numpy_sortby, c2numpy_summarize or c2numpy_prescale changes a column's type and
+    // the row layout, so their columns are checked and located here
+    for (size_t k = 0;  k < writer->sortKeys.size();  ++k)
+        if (!c2numpy_numeric(writer->columnTypes[writer->sortKeys[k]])) return -1;
+    for (size_t i = 0;  i < writer->fileSummaries.size();  ++i)
+        if (!c2numpy_numeric(writer->columnTypes[writer->fileSummaries[i].column])) return -1;
+    if (writer->prescaleColumn >= 0) {
+        writer->prescaleOffset = c2numpy_offset(writer, writer->columnNames[writer->prescaleColumn]);
+        writer->prescaleSize = atoi(c2numpy_descr(writer->columnTypes[writer->prescaleColumn]) + 2);
+    }
+    if (writer->matrix) {
+        if (writer->numColumns == 0) return -1;
+        for (int32_t column = 1;  column < writer->numColumns;  ++column)
+            if (writer->columnTypes[column] != writer->columnTypes[0]) return -1;
+
+        // the header has only one type, so the names go to <prefix>columns.txt, one per line
+        if (writer->currentFileNumber == 0) {
+            std::string names;
+            for (int32_t column = 0;  column < writer->numColumns;  ++column)
+                names += writer->columnNames[column] + "\n";
+            if (c2numpy_sidecar(writer, "columns.txt", names) != 0) return -1;
+        }
+    }
+
+    // how to undo the transforms, as a Python literal (c2numpy.load applies it)
+    if (writer->currentFileNumber == 0) {
+        std::stringstream transforms;
+        transforms.precision(17);
+        for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+            const c2numpy_transform &transform = writer->transforms[column];
+            if (transform.kind == C2NUMPY_NO_TRANSFORM) continue;
+            transforms << (transforms.str() == "" ? "{" : ", ") << "'" << writer->columnNames[column] << "': {'transform': ";
+            if (transform.kind == C2NUMPY_DOWNCAST)
+                transforms << "'downcast'";
+            else if (transform.kind == C2NUMPY_QUANTIZE)
+                transforms << "'quantize', 'scale': " << transform.scale << ", 'offset': " << transform.offset;
+            else
+                transforms << "'truncate', 'mantissaBits': " << transform.mantissaBits;
+            transforms << ", 'dtype': '" << c2numpy_descr(transform.declared) << "'}";
+        }
+        if (transforms.str() != "") {
+            transforms << "}\n";
+            if (c2numpy_sidecar(writer, "transforms.txt", transforms.str()) != 0) return -1;
+        }
+    }
+
+    if (writer->currentFileNumber == 0)
+        for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+            std::string names;
+            for (size_t bit = 0;  bit < writer->flagNames[column].size();  ++bit)
+                names += writer->flagNames[column][bit] + "\n";
+            if (names != ""  &&  c2numpy_sidecar(writer, writer->columnNames[column] + ".flags.txt", names) != 0) return -1;
+        }
+
     std::stringstream fileNameStream;
     fileNameStream << writer->outputFilePrefix;
     fileNameStream << writer->currentFileNumber;
-    fileNameStream << ".npy";
-    std::string fileName = fileNameStream.str();
-    writer->file = fopen(fileName.c_str(), "wb");
+    fileNameStream << (writer->arrowIPC ? ".arrow" : ".npy");
+    writer->currentFileName = fileNameStream.str();
+    if (writer->sink.open(writer->sink.state, writer->currentFileName.c_str()) != 0)
+        return -1;
+    writer->fileOpen = 1;
+    writer->fileBytes = 0;
+    writer->bufferUsed = 0;
+    // Fortran order is a transposition of the whole file, and a sink that can't patch needs the right row count up front
+    writer->holdFile = writer->fortranOrder  ||  writer->sink.patch == NULL  ||  !writer->sortKeys.empty()  ||  writer->sampleSize > 0;
+    writer->rowSize = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        writer->rowSize += atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
 
-    std::stringstream headerStream;
-    headerStream << "{'descr': [";
+    // an Arrow file is column by column too, and its metadata needs the row count: c2numpy_finish writes it all
+    if (writer->arrowIPC) {
+        writer->holdFile = 1;
+        writer->headerBytes = 0;
+        C2NUMPY_STATS_COUNT(filesOpened, 1)
+        C2NUMPY_STATS_END(openStart, openTime)
+        return 0;
+    }
 
-    int column;
-    for (column = 0;  column < writer->numColumns;  ++column) {
-      headerStream << "('" << writer->columnNames[column] << "', '" << c2numpy_descr(writer->columnTypes[column]) << "')";
-      if (column < writer->numColumns - 1)
-        headerStream << ", ";
+    std::stringstream headerStream;
+    if (writer->matrix) {
+      headerStream << "{'descr': '" << c2numpy_descr(writer->columnTypes[0]) << "', 'fortran_order': ";
+      headerStream << (writer->fortranOrder ? "True" : "False") << ", 'shape': (";
     }
+    else {
+      headerStream << "{'descr': [";
 
-    headerStream << "], 'fortran_order': False, 'shape': (";
+      int column;
+      for (column = 0;  column < writer->numColumns;  ++column) {
+        headerStream << "('" << writer->columnNames[column] << "', '" << c2numpy_descr(writer->columnTypes[column]) << "')";
+        if (column < writer->numColumns - 1)
+          headerStream << ", ";
+      }
+
+      headerStream << "], 'fortran_order': False, 'shape': (";
+    }
 
     writer->sizeSeekPosition = headerStream.str().size();
 
@@ -188,7 +1452,10 @@ int c2numpy_open(c2numpy_writer *writer) {
 
     writer->sizeSeekSize = headerStream.str().size() - writer->sizeSeekPosition;
 
-    headerStream << ",), }";
+    if (writer->matrix)
+      headerStream << ", " << writer->numColumns << "), }";
+    else
+      headerStream << ",), }";
 
     int headerSize = headerStream.str().size();
     char version = 1;
@@ -200,49 +1467,649 @@ int c2numpy_open(c2numpy_writer *writer) {
       if (headerSize > 65535) version = 2;
     }
 
-    fwrite("\x93NUMPY", 1, 6, writer->file);
+    // the header stays in the buffer with the first rows; if the file ends before it is
+    // flushed, the row count can be fixed without a patch
+    c2numpy_put(writer, "\x93NUMPY", 6);
     if (version == 1) {
-      fwrite("\x01\x00", 1, 2, writer->file);
-      fwrite(&headerSize, 1, 2, writer->file);
+      c2numpy_put(writer, "\x01\x00", 2);
+      c2numpy_put(writer, &headerSize, 2);
       writer->sizeSeekPosition += 6 + 2 + 2;
     }
     else {
-      fwrite("\x02\x00", 1, 2, writer->file);
-      fwrite(&headerSize, 1, 4, writer->file);
+      c2numpy_put(writer, "\x02\x00", 2);
+      c2numpy_put(writer, &headerSize, 4);
       writer->sizeSeekPosition += 6 + 2 + 4;
     }
 
     std::string header = headerStream.str();
-    fwrite(header.c_str(), 1, header.size(), writer->file);
+    c2numpy_put(writer, header.c_str(), header.size());
+    writer->headerBytes = writer->bufferUsed;
+
+    C2NUMPY_STATS_COUNT(filesOpened, 1)
+    C2NUMPY_STATS_END(openStart, openTime)
+    return 0;
+}
+
+#ifdef C2NUMPY_STATS
+inline void c2numpy_stats_row(c2numpy_writer *writer) {
+    writer->stats.rows += 1;
+    if (writer->statsFunction != NULL  &&  writer->stats.rows % writer->statsEveryRows == 0)
+        writer->statsFunction(&writer->stats, writer->statsUserData);
+}
+#define C2NUMPY_STATS_ROW c2numpy_stats_row(writer);
+#else
+#define C2NUMPY_STATS_ROW
+#endif
+
+// Rewrite <prefix><column>.categories.npy for each C2NUMPY_CATEGORY column that has new strings: all of
+// its strings so far, as a 1-D array indexed by code. Codes don't change from file to file, so the
+// latest covers them all.
+int c2numpy_write_categories(c2numpy_writer *writer) {
+    int status = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        if (writer->columnTypes[column] != C2NUMPY_CATEGORY) continue;
+        const std::vector<std::string> &strings = writer->categories[column];
+        if (writer->categoriesWritten[column] == (int64_t)strings.size()) continue;
+        writer->categoriesWritten[column] = strings.size();
+
+        size_t width = 1;
+        for (size_t i = 0;  i < strings.size();  ++i)
+            width = std::max(width, strings[i].size());
+
+        std::stringstream headerStream;
+        headerStream << "{'descr': '|S" << width << "', 'fortran_order': False, 'shape': (" << strings.size() << ",), }";
+        std::string header = headerStream.str();
+        while ((6 + 2 + 4 + header.size()) % 16 != 0)
+            header += " ";
+        uint32_t headerSize = header.size();
+
+        std::string contents("\x93NUMPY\x02\x00", 8);
+        contents.append((const char*)&headerSize, 4);
+        contents += header;
+        for (size_t i = 0;  i < strings.size();  ++i) {
+            contents += strings[i];
+            contents.append(width - strings[i].size(), '\0');
+        }
+        status |= c2numpy_sidecar(writer, writer->columnNames[column] + ".categories.npy", contents);
+    }
+    return status;
+}
+
+// the header of a small, 1-D .npy sidecar with the given descr
+std::string c2numpy_sidecar_header(const std::string &descr, int64_t length) {
+    std::stringstream headerStream;
+    headerStream << "{'descr': " << descr << ", 'fortran_order': False, 'shape': (" << length << ",), }";
+    std::string header = headerStream.str();
+    while ((6 + 2 + 4 + header.size()) % 16 != 0)
+        header += " ";
+    uint32_t headerSize = header.size();
+
+    std::string contents("\x93NUMPY\x02\x00", 8);
+    contents.append((const char*)&headerSize, 4);
+    return contents + header;
+}
+
+// <prefix><number>.valid.npy, only if the file has nulls: a record array with a u1 field for each
+// nullable column, which is its validity bitmap for this file (bit set if valid, least significant
+// first, as numpy.unpackbits(..., bitorder="little") reads it)
+int c2numpy_write_validity(c2numpy_writer *writer, int64_t numRows) {
+    int anyNulls = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        anyNulls = anyNulls  ||  writer->nullCounts[column] > 0;
+    if (!anyNulls) return 0;
+
+    int64_t numBytes = (numRows + 7) / 8;
+    std::vector<std::vector<uint8_t> > valid;
+    std::stringstream headerStream;
+    headerStream << "[";
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->nullCounts[column] >= 0) {
+            if (!valid.empty()) headerStream << ", ";
+            headerStream << "('" << writer->columnNames[column] << "', '|u1')";
+            valid.push_back(std::vector<uint8_t>(numBytes + 1));
+            c2numpy_validity(writer, column, 0, numRows, &valid.back()[0]);
+        }
+    headerStream << "]";
+    std::string contents = c2numpy_sidecar_header(headerStream.str(), numBytes);
+    for (int64_t i = 0;  i < numBytes;  ++i)
+        for (size_t j = 0;  j < valid.size();  ++j)
+            contents += (char)valid[j][i];
+
+    std::stringstream suffix;
+    suffix << writer->currentFileNumber << ".valid.npy";
+    return c2numpy_sidecar(writer, suffix.str(), contents);
+}
+
+// <prefix>groups.npy: a record array with an <i8 field for each group key, then file (<i4), start
+// (first row in that file) and length (rows, which may run into the next files), sorted by key so that
+// a reader finds a group with one binary search
+int c2numpy_write_groups(c2numpy_writer *writer) {
+    size_t numKeys = writer->groupKeys.size();
+    size_t stride = numKeys + 3;
+    size_t numGroups = writer->groups.size() / stride;
+    const int64_t *groups = writer->groups.data();
+
+    // by key, then by write order
+    std::vector<std::pair<std::vector<int64_t>, size_t> > order(numGroups);
+    for (size_t i = 0;  i < numGroups;  ++i)
+        order[i] = std::make_pair(std::vector<int64_t>(groups + i*stride, groups + i*stride + numKeys), i);
+    std::sort(order.begin(), order.end());
+
+    std::stringstream descr;
+    descr << "[";
+    for (size_t k = 0;  k < numKeys;  ++k)
+        descr << "('" << writer->groupKeys[k] << "', '<i8'), ";
+    descr << "('file', '<i4'), ('start', '<i8'), ('length', '<i8')]";
+    std::string contents = c2numpy_sidecar_header(descr.str(), numGroups);
+
+    // called after the last file is finished
+    for (size_t i = 0;  i < numGroups;  ++i) {
+        size_t which = order[i].second;
+        const int64_t *group = groups + which*stride;
+        int32_t file = (int32_t)group[numKeys];
+        int64_t end = which + 1 < numGroups ? groups[(which + 1)*stride + numKeys + 2] : writer->rowsFinished;
+        int64_t length = end - group[numKeys + 2];
+        contents.append((const char*)group, numKeys * sizeof(int64_t));
+        contents.append((const char*)&file, sizeof(int32_t));
+        contents.append((const char*)&group[numKeys + 1], sizeof(int64_t));
+        contents.append((const char*)&length, sizeof(int64_t));
+    }
+    return c2numpy_sidecar(writer, "groups.npy", contents);
+}
+
+template <typename T>
+inline void c2numpy_gather_values(const char *items, size_t rowSize, int64_t numRows, double *values) {
+    for (int64_t row = 0;  row < numRows;  ++row) {
+        T item;
+        memcpy(&item, items + row * rowSize, sizeof(T));
+        values[row] = (double)item;
+    }
+}
+
+// merge b into a (Chan et al.'s pairwise update of the mean and m2)
+inline void c2numpy_merge_summary(c2numpy_summary &a, const c2numpy_summary &b) {
+    int64_t count = a.count + b.count;
+    if (b.count > 0) {
+        double delta = b.mean - a.mean;
+        a.mean += delta * b.count / count;
+        a.m2 += b.m2 + delta * delta * a.count * b.count / count;
+    }
+    a.count = count;
+    a.nulls += b.nulls;
+    a.nans += b.nans;
+    a.min = std::min(a.min, b.min);
+    a.max = std::max(a.max, b.max);
+    for (size_t i = 0;  i < a.bins.size();  ++i)
+        a.bins[i] += b.bins[i];
+}
+
+// Add the rows in the buffer to fileSummaries, just before they leave it (or are rearranged), a column
+// at a time: gather its values, drop nulls and nan, then a pass for the sum, min and max and one for m2.
+void c2numpy_summarize_buffer(c2numpy_writer *writer) {
+    size_t start = writer->fileBytes == 0 ? writer->headerBytes : 0;
+    int64_t numRows = (writer->bufferUsed - start) / writer->rowSize;
+    if (numRows <= 0) return;
+    const char *rows = &writer->buffer[start];
+    std::vector<double> values(numRows);
+
+    for (size_t i = 0;  i < writer->fileSummaries.size();  ++i) {
+        c2numpy_summary &summary = writer->fileSummaries[i];
+        int32_t column = summary.column;
+        const char *items = rows + c2numpy_offset(writer, writer->columnNames[column]);
+        double *out = &values[0];
+        switch (writer->columnTypes[column]) {
+          case C2NUMPY_BOOL:
+          case C2NUMPY_INT8:      c2numpy_gather_values<int8_t>(items, writer->rowSize, numRows, out);    break;
+          case C2NUMPY_UINT8:     c2numpy_gather_values<uint8_t>(items, writer->rowSize, numRows, out);   break;
+          case C2NUMPY_INT16:     c2numpy_gather_values<int16_t>(items, writer->rowSize, numRows, out);   break;
+          case C2NUMPY_UINT16:    c2numpy_gather_values<uint16_t>(items, writer->rowSize, numRows, out);  break;
+          case C2NUMPY_INTC:
+          case C2NUMPY_INT32:
+          case C2NUMPY_CATEGORY:  c2numpy_gather_values<int32_t>(items, writer->rowSize, numRows, out);   break;
+          case C2NUMPY_UINT32:    c2numpy_gather_values<uint32_t>(items, writer->rowSize, numRows, out);  break;
+          case C2NUMPY_INT:
+          case C2NUMPY_INTP:
+          case C2NUMPY_INT64:     c2numpy_gather_values<int64_t>(items, writer->rowSize, numRows, out);   break;
+          case C2NUMPY_UINT64:    c2numpy_gather_values<uint64_t>(items, writer->rowSize, numRows, out);  break;
+          case C2NUMPY_FLOAT32:   c2numpy_gather_values<float>(items, writer->rowSize, numRows, out);     break;
+          default:                c2numpy_gather_values<double>(items, writer->rowSize, numRows, out);
+        }
+
+        const c2numpy_transform &transform = writer->transforms[column];
+        int64_t count = 0;
+        c2numpy_summary batch = {column, 0, 0, 0, 0.0, 0.0, INFINITY, -INFINITY, summary.low, summary.high, std::vector<int64_t>(summary.bins.size(), 0)};
+        const std::vector<uint8_t> &nulls = writer->nulls[column];
+        for (int64_t row = 0;  row < numRows;  ++row) {
+            size_t inFile = writer->summarizedRows + row;
+            if (writer->nullCounts[column] > 0  &&  inFile / 8 < nulls.size()  &&  ((nulls[inFile / 8] >> (inFile % 8)) & 1))
+                batch.nulls += 1;
+            else if (values[row] != values[row])
+                batch.nans += 1;
+            else
+                values[count++] = values[row];
+        }
+        if (transform.kind == C2NUMPY_QUANTIZE)
+            for (int64_t j = 0;  j < count;  ++j)
+                values[j] = values[j] * transform.scale + transform.offset;
+
+        double sum = 0.0;
+        for (int64_t j = 0;  j < count;  ++j) {
+            sum += values[j];
+            batch.min = std::min(batch.min, values[j]);
+            batch.max = std::max(batch.max, values[j]);
+        }
+        batch.count = count;
+        batch.mean = count > 0 ? sum / count : 0.0;
+        for (int64_t j = 0;  j < count;  ++j)
+            batch.m2 += (values[j] - batch.mean) * (values[j] - batch.mean);
+
+        if (!batch.bins.empty()) {
+            int64_t numBins = batch.bins.size() - 2;
+            double scale = numBins / (batch.high - batch.low);
+            for (int64_t j = 0;  j < count;  ++j) {
+                double bin = (values[j] - batch.low) * scale;
+                batch.bins[bin < 0.0 ? 0 : bin >= numBins ? numBins + 1 : (int64_t)bin + 1] += 1;
+            }
+        }
+        c2numpy_merge_summary(summary, batch);
+    }
+    writer->summarizedRows += numRows;
+}
+
+// {"rows": ..., "columns": {"name": {"count": ..., ...}, ...}}, with null for the mean, variance, min
+// and max of a column without values
+std::string c2numpy_summary_json(c2numpy_writer *writer, const std::vector<c2numpy_summary> &summaries, int64_t numRows) {
+    std::stringstream out;
+    out.precision(17);
+    out << "{\"rows\": " << numRows << ", \"columns\": {";
+    for (size_t i = 0;  i < summaries.size();  ++i) {
+        const c2numpy_summary &summary = summaries[i];
+        out << (i == 0 ? "" : ", ") << "\"" << writer->columnNames[summary.column] << "\": {\"count\": " << summary.count;
+        out << ", \"nulls\": " << summary.nulls << ", \"nans\": " << summary.nans;
+        if (summary.count > 0)
+            out << ", \"mean\": " << summary.mean << ", \"variance\": " << summary.m2 / summary.count << ", \"min\": " << summary.min << ", \"max\": " << summary.max;
+        else
+            out << ", \"mean\": null, \"variance\": null, \"min\": null, \"max\": null";
+        if (!summary.bins.empty()) {
+            out << ", \"low\": " << summary.low << ", \"high\": " << summary.high << ", \"underflow\": " << summary.bins.front();
+            out << ", \"overflow\": " << summary.bins.back() << ", \"bins\": [";
+            for (size_t bin = 1;  bin + 1 < summary.bins.size();  ++bin)
+                out << (bin == 1 ? "" : ", ") << summary.bins[bin];
+            out << "]";
+        }
+        out << "}";
+    }
+    out << "}}\n";
+    return out.str();
+}
+
+// a key item as an unsigned integer with the same order (so that it can be sorted byte by byte)
+inline uint64_t c2numpy_radixkey(const char *item, char kind, int size) {
+    uint64_t bits = 0;
+    memcpy(&bits, item, size);   // little-endian
+    uint64_t sign = (uint64_t)1 << (8*size - 1);
+    if (kind == 'i')
+        return bits ^ sign;
+    if (kind == 'f')
+        return (bits & sign) ? ~bits & (sign | (sign - 1)) : bits | sign;
+    return bits;
+}
+
+inline bool c2numpy_isnan_item(const char *item, int size) {
+    if (size == 4) { float x;  memcpy(&x, item, 4);  return x != x; }
+    double x;  memcpy(&x, item, 8);  return x != x;
+}
+
+inline void c2numpy_format_item(std::stringstream &out, const char *item, c2numpy_type type) {
+    switch (type) {
+      case C2NUMPY_FLOAT32: { float x;  memcpy(&x, item, 4);  out << x;  break; }
+      case C2NUMPY_FLOAT:
+      case C2NUMPY_FLOAT64: { double x;  memcpy(&x, item, 8);  out << x;  break; }
+      default: {
+          int size = atoi(c2numpy_descr(type) + 2);
+          uint64_t bits = 0;
+          memcpy(&bits, item, size);
+          if (c2numpy_descr(type)[1] == 'i'  &&  size < 8  &&  (bits >> (8*size - 1)))
+              bits |= ~(uint64_t)0 << (8*size);   // sign-extend
+          if (c2numpy_descr(type)[1] == 'i')
+              out << (int64_t)bits;
+          else
+              out << bits;
+      }
+    }
+}
+
+// Reorder the rows of a held file by the sort keys with a stable LSD radix sort: one counting pass per
+// key byte, least significant key first, skipping bytes that are the same in every row (such as the
+// high bytes of run numbers), then a pass that moves a nullable key's nulls after its values. Moves the
+// null bits with their rows and notes the file's key ranges, which leave out nulls and nan.
+void c2numpy_sortrows(c2numpy_writer *writer) {
+    int64_t numRows = writer->currentRowInFile;
+    std::vector<size_t> offsets(writer->numColumns + 1, 0);
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        offsets[column + 1] = offsets[column] + atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
+    size_t rowSize = offsets[writer->numColumns];
+    char *rows = &writer->buffer[writer->headerBytes];
+
+    std::vector<uint32_t> order(numRows);
+    std::vector<uint32_t> scratch(numRows);
+    for (int64_t row = 0;  row < numRows;  ++row)
+        order[row] = row;
+
+    std::stringstream ranges;
+    ranges.precision(17);
+    ranges << writer->currentFileNumber;
+    std::vector<uint64_t> keys(numRows);
+    for (size_t k = writer->sortKeys.size();  k > 0;  --k) {
+        int32_t column = writer->sortKeys[k - 1];
+        char kind = c2numpy_descr(writer->columnTypes[column])[1];
+        int size = offsets[column + 1] - offsets[column];
+        for (int64_t row = 0;  row < numRows;  ++row)
+            keys[row] = c2numpy_radixkey(rows + row * rowSize + offsets[column], kind, size);
+
+        for (int byte = 0;  byte < size;  ++byte) {
+            int64_t counts[257] = {0};
+            for (int64_t row = 0;  row < numRows;  ++row)
+                counts[((keys[row] >> (8*byte)) & 0xff) + 1] += 1;
+            if (*std::max_element(counts, counts + 257) == numRows) continue;
+            for (int bucket = 0;  bucket < 256;  ++bucket)
+                counts[bucket + 1] += counts[bucket];
+            for (int64_t i = 0;  i < numRows;  ++i)
+                scratch[counts[(keys[order[i]] >> (8*byte)) & 0xff]++] = order[i];
+            order.swap(scratch);
+        }
+
+        // nulls last: the null bit is this key's most significant digit
+        if (writer->nullCounts[column] > 0) {
+            int64_t next = 0;
+            for (int64_t i = 0;  i < numRows;  ++i)
+                if (!c2numpy_isnull(writer, column, order[i])) scratch[next++] = order[i];
+            for (int64_t i = 0;  i < numRows;  ++i)
+                if (c2numpy_isnull(writer, column, order[i])) scratch[next++] = order[i];
+            order.swap(scratch);
+        }
+    }
+
+    // ranges in the order of the keys, now that the rows are sorted (the first key's are at the ends)
+    for (size_t k = 0;  k < writer->sortKeys.size();  ++k) {
+        int32_t column = writer->sortKeys[k];
+        char kind = c2numpy_descr(writer->columnTypes[column])[1];
+        int size = offsets[column + 1] - offsets[column];
+        int64_t lowest = -1, highest = -1;
+        uint64_t lowestKey = 0, highestKey = 0;
+        for (int64_t row = 0;  row < numRows;  ++row) {
+            const char *item = rows + row * rowSize + offsets[column];
+            if (writer->nullCounts[column] > 0  &&  c2numpy_isnull(writer, column, row)) continue;
+            if (kind == 'f'  &&  c2numpy_isnan_item(item, size)) continue;
+            uint64_t key = c2numpy_radixkey(item, kind, size);
+            if (lowest < 0  ||  key < lowestKey) { lowest = row;  lowestKey = key; }
+            if (highest < 0  ||  key > highestKey) { highest = row;  highestKey = key; }
+        }
+        // a file with no values of a key has a range that nothing falls in
+        if (lowest < 0) {
+            ranges << " nan nan";
+            continue;
+        }
+        ranges << " ";
+        c2numpy_format_item(ranges, rows + lowest * rowSize + offsets[column], writer->columnTypes[column]);
+        ranges << " ";
+        c2numpy_format_item(ranges, rows + highest * rowSize + offsets[column], writer->columnTypes[column]);
+    }
+    writer->keyRanges += ranges.str() + "\n";
+
+    std::vector<char> sorted(numRows * rowSize);
+    for (int64_t i = 0;  i < numRows;  ++i)
+        memcpy(&sorted[i * rowSize], rows + (size_t)order[i] * rowSize, rowSize);
+    memcpy(rows, &sorted[0], sorted.size());
+
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->nullCounts[column] > 0) {
+            std::vector<uint8_t> &bits = writer->nulls[column];
+            std::vector<uint8_t> moved((numRows + 7) / 8, 0);
+            for (int64_t i = 0;  i < numRows;  ++i) {
+                size_t from = order[i];
+                if (from / 8 < bits.size()  &&  (bits[from / 8] >> (from % 8)) & 1)
+                    moved[i / 8] |= (uint8_t)(1 << (i % 8));
+            }
+            bits.swap(moved);
+        }
+}
+
+// Add a line for the finished file to the checksums manifest: its name (after the prefix), size and
+// CRC32C (in hex), then if there are blocks, the block size and the CRC32C of each block. The header's and the data's CRCs are combined.
+void c2numpy_checksum_file(c2numpy_writer *writer) {
+    const std::string &header = writer->checksumHeader;
+    int64_t headerBytes = header.size();
+    std::stringstream line;
+    line << writer->currentFileName.substr(writer->outputFilePrefix.size()) << " " << headerBytes + writer->checksumBytes;
+    uint32_t headerChecksum = c2numpy_crc32c(0, header.data(), headerBytes);
+    char hex[16];
+    snprintf(hex, sizeof(hex), " %08x", c2numpy_crc32c_combine(headerChecksum, writer->checksum, writer->checksumBytes));
+    line << hex;
+
+    if (writer->checksumBlockSize > 0) {
+        int64_t blockSize = writer->checksumBlockSize;
+        line << " " << blockSize;
+        int64_t fileBytes = headerBytes + writer->checksumBytes;
+        std::vector<uint32_t> blocks;
+        for (int64_t start = 0;  start + blockSize <= headerBytes;  start += blockSize)
+            blocks.push_back(c2numpy_crc32c(0, header.data() + start, blockSize));
+
+        // the last block may be short, and the first one after the header may have begun in it
+        std::vector<uint32_t> &data = writer->blockChecksums;
+        if (fileBytes % blockSize != 0  &&  fileBytes > headerBytes - headerBytes % blockSize)
+            data.push_back(writer->blockChecksum);
+        int64_t inHeader = headerBytes % blockSize;
+        if (inHeader != 0) {
+            uint32_t headerPart = c2numpy_crc32c(0, header.data() + headerBytes - inHeader, inHeader);
+            int64_t dataPart = std::min(blockSize - inHeader, writer->checksumBytes);
+            data[0] = c2numpy_crc32c_combine(headerPart, data[0], dataPart);
+        }
+        blocks.insert(blocks.end(), data.begin(), data.end());
+
+        for (size_t i = 0;  i < blocks.size();  ++i) {
+            snprintf(hex, sizeof(hex), " %08x", blocks[i]);
+            line << hex;
+        }
+    }
+    writer->checksumManifest += line.str() + "\n";
+
+    writer->checksumHeader.clear();
+    writer->checksum = 0;
+    writer->checksumBytes = 0;
+    writer->blockChecksum = 0;
+    writer->blockChecksums.clear();
+}
+
+// write the real number of rows into the header (if short), hand everything to the sink and close it
+int c2numpy_finish(c2numpy_writer *writer) {
+    int status = 0;
+
+    if (!writer->fileSummaries.empty())
+        c2numpy_summarize_buffer(writer);
+    if (!writer->sortKeys.empty()  &&  writer->currentRowInFile > 0)
+        c2numpy_sortrows(writer);
+
+    // the whole file is in the buffer: rearrange it from rows of items to columns of items
+    if (writer->fortranOrder  &&  writer->currentRowInFile > 0) {
+        size_t itemSize = atoi(c2numpy_descr(writer->columnTypes[0]) + 2);
+        size_t numRows = writer->currentRowInFile;
+        size_t numColumns = writer->numColumns;
+        const char *rows = &writer->buffer[writer->headerBytes];
+        std::vector<char> columns(numRows * numColumns * itemSize);
+        for (size_t row = 0;  row < numRows;  ++row)
+            for (size_t column = 0;  column < numColumns;  ++column)
+                memcpy(&columns[(column * numRows + row) * itemSize], &rows[(row * numColumns + column) * itemSize], itemSize);
+        memcpy(&writer->buffer[writer->headerBytes], &columns[0], columns.size());
+    }
+
+    if (writer->arrowIPC) {
+        std::string file = c2numpy_arrow_ipc_file(writer, &writer->buffer[0], writer->currentRowInFile);
+        writer->bufferUsed = 0;
+        c2numpy_put(writer, file.data(), file.size());
+    }
+
+    // we wrote fewer rows than we promised
+    else if (writer->currentRowInFile < writer->numRowsPerFile) {
+        // overwrite the promise with the actual number, padded with spaces (it MUST be fewer or an equal number of digits)
+        char digits[32];
+        int numDigits = snprintf(digits, sizeof(digits), "%d", writer->currentRowInFile);
+        memset(digits + numDigits, ' ', writer->sizeSeekSize - numDigits);
+
+        if (writer->fileBytes == 0)   // header hasn't left the buffer yet
+            memcpy(&writer->buffer[writer->sizeSeekPosition], digits, writer->sizeSeekSize);
+        else if (writer->sink.patch != NULL) {
+            if (writer->checksums)
+                memcpy(&writer->checksumHeader[writer->sizeSeekPosition], digits, writer->sizeSeekSize);
+            C2NUMPY_STATS_COUNT(writeCalls, 1)
+            C2NUMPY_STATS_COUNT(bytes, writer->sizeSeekSize)
+            status |= writer->sink.patch(writer->sink.state, writer->sizeSeekPosition, digits, writer->sizeSeekSize);
+        }
+        else
+            status = -1;
+    }
+
+    status |= c2numpy_flush(writer);
+    if (writer->checksums)
+        c2numpy_checksum_file(writer);
+    status |= writer->sink.close(writer->sink.state);
+    writer->fileOpen = 0;
+    writer->rowsFinished += writer->currentRowInFile;
+    writer->sampleSeen = 0;
+    status |= c2numpy_write_categories(writer);
+    if (!writer->sortKeys.empty())
+        status |= c2numpy_sidecar(writer, "keyranges.txt", writer->keyRanges);
+
+    if (!writer->fileSummaries.empty()) {
+        std::stringstream suffix;
+        suffix << writer->currentFileNumber << ".summary.json";
+        status |= c2numpy_sidecar(writer, suffix.str(), c2numpy_summary_json(writer, writer->fileSummaries, writer->currentRowInFile));
+        for (size_t i = 0;  i < writer->fileSummaries.size();  ++i) {
+            c2numpy_summary &summary = writer->fileSummaries[i];
+            c2numpy_merge_summary(writer->runSummaries[i], summary);
+            c2numpy_summary empty = {summary.column, 0, 0, 0, 0.0, 0.0, INFINITY, -INFINITY, summary.low, summary.high, std::vector<int64_t>(summary.bins.size(), 0)};
+            summary = empty;
+        }
+        writer->summarizedRows = 0;
+    }
+
+    // an Arrow file has the validity bitmaps already
+    if (!writer->arrowIPC)
+        status |= c2numpy_write_validity(writer, writer->currentRowInFile);
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->nullCounts[column] > 0) {
+            writer->nullCounts[column] = 0;
+            writer->nulls[column].clear();
+        }
+    return status == 0 ? 0 : -1;
+}
+
+// SplitMix64's mixing function: a well-spread 64-bit hash (and, of a counter, a random number generator)
+inline uint64_t c2numpy_hash(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// move the null bits of a row of the current file onto another row, or discard them if to < 0
+inline void c2numpy_movenulls(c2numpy_writer *writer, int64_t from, int64_t to) {
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        if (writer->nullCounts[column] <= 0) continue;
+        std::vector<uint8_t> &bits = writer->nulls[column];
+        int isNull = (size_t)from / 8 < bits.size()  &&  ((bits[from / 8] >> (from % 8)) & 1);
+        if (to >= 0  &&  (size_t)to / 8 < bits.size()  &&  ((bits[to / 8] >> (to % 8)) & 1)) {
+            bits[to / 8] &= (uint8_t)~(1 << (to % 8));
+            writer->nullCounts[column] -= 1;
+        }
+        if (isNull) {
+            bits[from / 8] &= (uint8_t)~(1 << (from % 8));
+            writer->nullCounts[column] -= 1;
+            if (to >= 0)
+                c2numpy_setnull(writer, column, to);
+        }
+    }
+}
+
+// The row just assembled at the end of the buffer goes through the filters, the prescale and the
+// sample. Returns 1 if it stays there as the next row of the file; otherwise it's taken off the buffer,
+// possibly after replacing an earlier row of the sample.
+inline int c2numpy_stagerow(c2numpy_writer *writer) {
+    const char *row = &writer->buffer[writer->bufferUsed - writer->rowSize];
+    int keep = 1;
+    for (size_t i = 0;  keep  &&  i < writer->filters.size();  ++i)
+        keep = writer->filters[i](writer->filterUserData[i], row);
+
+    if (keep  &&  writer->prescaleColumn >= 0) {
+        uint64_t key = 0;
+        memcpy(&key, row + writer->prescaleOffset, writer->prescaleSize);
+        keep = (double)(c2numpy_hash(key) >> 11) < writer->prescaleFraction * 9007199254740992.0;   // 2**53
+    }
+
+    // reservoir sampling (Algorithm R): the n-th row replaces a random one of the sample with probability sampleSize/n
+    if (keep  &&  writer->sampleSize > 0) {
+        int64_t seen = writer->sampleSeen++;
+        if (seen >= writer->sampleSize) {
+            int64_t slot = c2numpy_hash(writer->sampleState++) % (uint64_t)(seen + 1);
+            if (slot < writer->sampleSize) {
+                memcpy(&writer->buffer[writer->headerBytes + slot * writer->rowSize], row, writer->rowSize);
+                c2numpy_movenulls(writer, writer->currentRowInFile, slot);
+            }
+            keep = 0;
+        }
+    }
+
+    if (!keep) {
+        writer->bufferUsed -= writer->rowSize;
+        c2numpy_movenulls(writer, writer->currentRowInFile, -1);
+    }
+    return keep;
+}
 
+inline int c2numpy_endrow(c2numpy_writer *writer) {
+    if (!writer->rowStage  ||  c2numpy_stagerow(writer))
+        writer->currentRowInFile += 1;
+    if (writer->currentRowInFile == writer->numRowsPerFile  ||  (writer->sampleSize > 0  &&  writer->sampleSeen == writer->numRowsPerFile)) {
+        C2NUMPY_STATS_BEGIN(rotateStart)
+        int status = c2numpy_finish(writer);
+        writer->currentRowInFile = 0;
+        writer->currentFileNumber += 1;
+        C2NUMPY_STATS_COUNT(filesRotated, 1)
+        C2NUMPY_STATS_END(rotateStart, rotateTime)
+        return status;
+    }
+    if (writer->bufferUsed >= writer->bufferFlush  &&  !writer->holdFile) {
+        if (!writer->fileSummaries.empty())
+            c2numpy_summarize_buffer(writer);
+        return c2numpy_flush(writer);
+    }
     return 0;
 }
 
-#define C2NUMPY_CHECK_ITEM {                                                    \
-    if (writer->file == NULL) {                                                 \
+#define C2NUMPY_CHECK_ITEM                                                      \
+    C2NUMPY_STATS_BEGIN(writeStart)                                             \
+    if (!writer->fileOpen) {                                                    \
         int status = c2numpy_open(writer);                                      \
         if (status != 0)                                                        \
             return status;                                                      \
-    }                                                                           \
-}
+    }
 
 #define C2NUMPY_INCREMENT_ITEM {                                                \
+    C2NUMPY_STATS_COUNT(items, 1)                                               \
     if (writer->currentColumn == 0) {                                           \
-        writer->currentRowInFile += 1;                                          \
-        if (writer->currentRowInFile == writer->numRowsPerFile) {               \
-            fclose(writer->file);                                               \
-            writer->file = NULL;                                                \
-            writer->currentRowInFile = 0;                                       \
-            writer->currentFileNumber += 1;                                     \
-        }                                                                       \
+        C2NUMPY_STATS_ROW                                                       \
+        int status = c2numpy_endrow(writer);                                    \
+        if (status != 0)                                                        \
+            return status;                                                      \
     }                                                                           \
+    C2NUMPY_STATS_END(writeStart, writeTime)                                    \
     return 0;                                                                   \
 }
 
 int c2numpy_bool(c2numpy_writer *writer, int8_t data) {   // "bool" is just a byte
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_BOOL) return -1;
-    fwrite(&data, sizeof(int8_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -250,7 +2117,7 @@ int c2numpy_bool(c2numpy_writer *writer, int8_t data) {   // "bool" is just a by
 int c2numpy_int(c2numpy_writer *writer, int64_t data) {   // Numpy's default int is 64-bit
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT) return -1;
-    fwrite(&data, sizeof(int64_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -258,7 +2125,7 @@ int c2numpy_int(c2numpy_writer *writer, int64_t data) {   // Numpy's default int
 int c2numpy_intc(c2numpy_writer *writer, int data) {      // the built-in C int
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INTC) return -1;
-    fwrite(&data, sizeof(int), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -266,7 +2133,7 @@ int c2numpy_intc(c2numpy_writer *writer, int data) {      // the built-in C int
 int c2numpy_intp(c2numpy_writer *writer, size_t data) {   // intp is Numpy's way of saying size_t
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INTP) return -1;
-    fwrite(&data, sizeof(size_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(size_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -274,7 +2141,7 @@ int c2numpy_intp(c2numpy_writer *writer, size_t data) {   // intp is Numpy's way
 int c2numpy_int8(c2numpy_writer *writer, int8_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT8) return -1;
-    fwrite(&data, sizeof(int8_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -282,7 +2149,7 @@ int c2numpy_int8(c2numpy_writer *writer, int8_t data) {
 int c2numpy_int16(c2numpy_writer *writer, int16_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT16) return -1;
-    fwrite(&data, sizeof(int16_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int16_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -290,7 +2157,7 @@ int c2numpy_int16(c2numpy_writer *writer, int16_t data) {
 int c2numpy_int32(c2numpy_writer *writer, int32_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT32) return -1;
-    fwrite(&data, sizeof(int32_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int32_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -298,7 +2165,7 @@ int c2numpy_int32(c2numpy_writer *writer, int32_t data) {
 int c2numpy_int64(c2numpy_writer *writer, int64_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT64) return -1;
-    fwrite(&data, sizeof(int64_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(int64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -306,7 +2173,7 @@ int c2numpy_int64(c2numpy_writer *writer, int64_t data) {
 int c2numpy_uint8(c2numpy_writer *writer, uint8_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT8) return -1;
-    fwrite(&data, sizeof(uint8_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(uint8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -314,7 +2181,7 @@ int c2numpy_uint8(c2numpy_writer *writer, uint8_t data) {
 int c2numpy_uint16(c2numpy_writer *writer, uint16_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT16) return -1;
-    fwrite(&data, sizeof(uint16_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(uint16_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -322,7 +2189,7 @@ int c2numpy_uint16(c2numpy_writer *writer, uint16_t data) {
 int c2numpy_uint32(c2numpy_writer *writer, uint32_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT32) return -1;
-    fwrite(&data, sizeof(uint32_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(uint32_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -330,15 +2197,23 @@ int c2numpy_uint32(c2numpy_writer *writer, uint32_t data) {
 int c2numpy_uint64(c2numpy_writer *writer, uint64_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT64) return -1;
-    fwrite(&data, sizeof(uint64_t), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(uint64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
 
 int c2numpy_float(c2numpy_writer *writer, double data) {   // Numpy's "float" is a double
     C2NUMPY_CHECK_ITEM
-    if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT) return -1;
-    fwrite(&data, sizeof(double), 1, writer->file);
+    const c2numpy_transform &transform = writer->transforms[writer->currentColumn];
+    if (transform.kind != C2NUMPY_NO_TRANSFORM  &&  transform.declared == C2NUMPY_FLOAT) {
+        char stored[8];
+        c2numpy_transform_items(transform, writer->columnTypes[writer->currentColumn], &data, stored, 1);
+        c2numpy_put(writer, stored, atoi(c2numpy_descr(writer->columnTypes[writer->currentColumn]) + 2));
+    }
+    else if (writer->columnTypes[writer->currentColumn] == C2NUMPY_FLOAT)
+        c2numpy_put(writer, &data, sizeof(double));
+    else
+        return -1;
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -346,7 +2221,7 @@ int c2numpy_float(c2numpy_writer *writer, double data) {   // Numpy's "float" is
 // int c2numpy_float16(c2numpy_writer *writer, ??? data) {   // how to do float16 in C?
 //     C2NUMPY_CHECK_ITEM
 //     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT16) return -1;
-//     fwrite(&data, sizeof(???), 1, writer->file);
+//     c2numpy_put(writer, &data, sizeof(???));
 //     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
 //     C2NUMPY_INCREMENT_ITEM
 // }
@@ -354,15 +2229,23 @@ int c2numpy_float(c2numpy_writer *writer, double data) {   // Numpy's "float" is
 int c2numpy_float32(c2numpy_writer *writer, float data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT32) return -1;
-    fwrite(&data, sizeof(float), 1, writer->file);
+    c2numpy_put(writer, &data, sizeof(float));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
 
 int c2numpy_float64(c2numpy_writer *writer, double data) {
     C2NUMPY_CHECK_ITEM
-    if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT64) return -1;
-    fwrite(&data, sizeof(double), 1, writer->file);
+    const c2numpy_transform &transform = writer->transforms[writer->currentColumn];
+    if (transform.kind != C2NUMPY_NO_TRANSFORM  &&  transform.declared == C2NUMPY_FLOAT64) {
+        char stored[8];
+        c2numpy_transform_items(transform, writer->columnTypes[writer->currentColumn], &data, stored, 1);
+        c2numpy_put(writer, stored, atoi(c2numpy_descr(writer->columnTypes[writer->currentColumn]) + 2));
+    }
+    else if (writer->columnTypes[writer->currentColumn] == C2NUMPY_FLOAT64)
+        c2numpy_put(writer, &data, sizeof(double));
+    else
+        return -1;
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -370,7 +2253,7 @@ int c2numpy_float64(c2numpy_writer *writer, double data) {
 // int c2numpy_complex(c2numpy_writer *writer, ??? data) {    // how to do complex in C?
 //     C2NUMPY_CHECK_ITEM
 //     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_COMPLEX) return -1;
-//     fwrite(&data, sizeof(???), 1, writer->file);
+//     c2numpy_put(writer, &data, sizeof(???));
 //     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
 //     C2NUMPY_INCREMENT_ITEM
 // }
@@ -378,7 +2261,7 @@ int c2numpy_float64(c2numpy_writer *writer, double data) {
 // int c2numpy_complex64(c2numpy_writer *writer, ??? data) {
 //     C2NUMPY_CHECK_ITEM
 //     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_COMPLEX64) return -1;
-//     fwrite(&data, sizeof(???), 1, writer->file);
+//     c2numpy_put(writer, &data, sizeof(???));
 //     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
 //     C2NUMPY_INCREMENT_ITEM
 // }
@@ -386,7 +2269,7 @@ int c2numpy_float64(c2numpy_writer *writer, double data) {
 // int c2numpy_complex128(c2numpy_writer *writer, ??? data) {
 //     C2NUMPY_CHECK_ITEM
 //     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_COMPLEX128) return -1;
-//     fwrite(&data, sizeof(???), 1, writer->file);
+//     c2numpy_put(writer, &data, sizeof(???));
 //     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
 //     C2NUMPY_INCREMENT_ITEM
 // }
@@ -396,7 +2279,7 @@ int c2numpy_string(c2numpy_writer *writer, const char *data) {
 
     int stringlength = writer->columnTypes[writer->currentColumn] - C2NUMPY_STRING;
     if (0 < stringlength  &&  stringlength < 155)
-        fwrite(data, 1, stringlength, writer->file);
+        c2numpy_put(writer, data, stringlength);
     else
         return -1;
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
@@ -404,25 +2287,409 @@ int c2numpy_string(c2numpy_writer *writer, const char *data) {
     C2NUMPY_INCREMENT_ITEM
 }
 
+// for C2NUMPY_CATEGORY columns: a new string gets the next code (the first is 0)
+int c2numpy_category(c2numpy_writer *writer, const char *data) {
+    C2NUMPY_CHECK_ITEM
+    if (writer->columnTypes[writer->currentColumn] != C2NUMPY_CATEGORY) return -1;
+
+    std::unordered_map<std::string, int32_t> &codes = writer->categoryCodes[writer->currentColumn];
+    std::string key(data);
+    std::unordered_map<std::string, int32_t>::const_iterator found = codes.find(key);
+    int32_t code;
+    if (found != codes.end())
+        code = found->second;
+    else {
+        code = codes.size();
+        codes[key] = code;
+        writer->categories[writer->currentColumn].push_back(key);
+    }
+    c2numpy_put(writer, &code, sizeof(int32_t));
+    writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
+
+    C2NUMPY_INCREMENT_ITEM
+}
+
+// all of a flags column's bits at once (bit i is the i-th name given to c2numpy_addflags)
+int c2numpy_flags(c2numpy_writer *writer, uint64_t mask) {
+    C2NUMPY_CHECK_ITEM
+    size_t numBits = writer->flagNames[writer->currentColumn].size();
+    if (numBits == 0) return -1;
+    if (numBits < 64  &&  (mask >> numBits) != 0) return -1;   // bits without names
+
+    // little-endian, so the low bytes are the narrower integer
+    c2numpy_put(writer, &mask, atoi(c2numpy_descr(writer->columnTypes[writer->currentColumn]) + 2));
+    writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
+
+    C2NUMPY_INCREMENT_ITEM
+}
+
+template <size_t N> int c2numpy_flags(c2numpy_writer *writer, const std::bitset<N> &bits) {
+    return c2numpy_flags(writer, (uint64_t)bits.to_ullong());
+}
+
+// a missing value in a nullable column: zeros in the record, and a cleared bit in the validity bitmap
+int c2numpy_null(c2numpy_writer *writer) {
+    C2NUMPY_CHECK_ITEM
+    if (writer->nullCounts[writer->currentColumn] < 0) return -1;
+
+    static const char zeros[256] = {0};
+    c2numpy_put(writer, zeros, atoi(c2numpy_descr(writer->columnTypes[writer->currentColumn]) + 2));
+    c2numpy_setnull(writer, writer->currentColumn, writer->currentRowInFile);
+    writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
+
+    C2NUMPY_INCREMENT_ITEM
+}
+
+// Column-batch path: append numRows whole rows at once, where columns[column] points to numRows
+// contiguous items of that column's type. Writes the same files as setter calls would, but with one
+// copy per item into the buffer and no per-item checks. Must be called between rows.
+// With valid non-NULL, valid[column] is NULL (no nulls) or a validity bitmap of numRows bits for that
+// (nullable) column: bit set if valid, least significant first, as in Arrow.
+int c2numpy_columns_valid(c2numpy_writer *writer, int64_t numRows, const void **columns, const uint8_t **valid) {
+    if (writer->currentColumn != 0) return -1;   // in the middle of a row
+    if (valid != NULL)
+        for (int32_t column = 0;  column < writer->numColumns;  ++column)
+            if (valid[column] != NULL  &&  writer->nullCounts[column] < 0) return -1;
+    C2NUMPY_STATS_BEGIN(writeStart)
+
+    std::vector<size_t> itemSizes(writer->numColumns);
+    size_t rowSize = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        if (writer->columnTypes[column] == C2NUMPY_CATEGORY) return -1;   // strings have to go through c2numpy_category
+        itemSizes[column] = atoi(c2numpy_descr(writer->columnTypes[column]) + 2);
+        rowSize += itemSizes[column];
+    }
+
+    // transformed columns come in as doubles: convert each one in a single pass
+    std::vector<const void*> sources(columns, columns + writer->numColumns);
+    std::vector<std::vector<char> > transformed(writer->numColumns);
+    for (int32_t column = 0;  column < writer->numColumns;  ++column)
+        if (writer->transforms[column].kind != C2NUMPY_NO_TRANSFORM) {
+            transformed[column].resize(numRows * itemSizes[column] + 1);
+            c2numpy_transform_items(writer->transforms[column], writer->columnTypes[column], (const double*)columns[column], &transformed[column][0], numRows);
+            sources[column] = &transformed[column][0];
+        }
+
+    int64_t done = 0;
+    while (done < numRows) {
+        if (!writer->fileOpen) {
+            int status = c2numpy_open(writer);
+            if (status != 0)
+                return status;
+        }
+
+        // no further than the end of this file, and one at a time if c2numpy_endrow might drop them
+        int64_t rows = numRows - done;
+        if (rows > writer->numRowsPerFile - writer->currentRowInFile)
+            rows = writer->numRowsPerFile - writer->currentRowInFile;
+        if (writer->rowStage)
+            rows = 1;
+
+        if (writer->bufferUsed + rows * rowSize > writer->buffer.size())
+            writer->buffer.resize(2 * (writer->bufferUsed + rows * rowSize));
+        char *out = &writer->buffer[writer->bufferUsed];
+        for (int64_t row = done;  row < done + rows;  ++row)
+            for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+                memcpy(out, (const char*)sources[column] + row * itemSizes[column], itemSizes[column]);
+                out += itemSizes[column];
+            }
+        writer->bufferUsed += rows * rowSize;
+
+        if (valid != NULL)
+            for (int32_t column = 0;  column < writer->numColumns;  ++column)
+                if (valid[column] != NULL)
+                    for (int64_t row = done;  row < done + rows;  ++row)
+                        if (!((valid[column][row / 8] >> (row % 8)) & 1))
+                            c2numpy_setnull(writer, column, writer->currentRowInFile + row - done);
+
+        C2NUMPY_STATS_COUNT(items, rows * writer->numColumns)
+        for (int64_t row = 0;  row < rows;  ++row) {
+            C2NUMPY_STATS_ROW
+        }
+
+        // c2numpy_endrow counts the last row and rotates or flushes as usual
+        writer->currentRowInFile += rows - 1;
+        int status = c2numpy_endrow(writer);
+        if (status != 0)
+            return status;
+        done += rows;
+    }
+
+    C2NUMPY_STATS_END(writeStart, writeTime)
+    return 0;
+}
+
+int c2numpy_columns(c2numpy_writer *writer, int64_t numRows, const void **columns) {
+    return c2numpy_columns_valid(writer, numRows, columns, NULL);
+}
+
+// end the current file now, with as many rows as it has; the next row starts a new one
+int c2numpy_rotate(c2numpy_writer *writer) {
+    if (writer->currentColumn != 0) return -1;   // in the middle of a row
+    if (!writer->fileOpen  ||  writer->currentRowInFile == 0) return 0;
+
+    C2NUMPY_STATS_BEGIN(rotateStart)
+    int status = c2numpy_finish(writer);
+    writer->currentRowInFile = 0;
+    writer->currentFileNumber += 1;
+    C2NUMPY_STATS_COUNT(filesRotated, 1)
+    C2NUMPY_STATS_END(rotateStart, rotateTime)
+    return status;
+}
+
 int c2numpy_close(c2numpy_writer *writer) {
-    if (writer->file != NULL) {
-        // we wrote fewer rows than we promised
-        if (writer->currentRowInFile < writer->numRowsPerFile) {
-            // so go back to the part of the header where that was written
-            fseek(writer->file, writer->sizeSeekPosition, SEEK_SET);
-            // overwrite it with spaces
-            int i;
-            for (i = 0;  i < writer->sizeSeekSize;  ++i)
-                fputc(' ', writer->file);
-            // now go back and write it again (it MUST be fewer or an equal number of digits)
-            fseek(writer->file, writer->sizeSeekPosition, SEEK_SET);
-            fprintf(writer->file, "%d", writer->currentRowInFile);
-        }
-        // now close it
-        fclose(writer->file);
+    C2NUMPY_STATS_BEGIN(closeStart)
+    int status = 0;
+    int anyRows = writer->fileOpen  ||  writer->currentFileNumber > 0;
+    if (writer->fileOpen)
+        status = c2numpy_finish(writer);
+    if (!writer->groupKeys.empty())
+        status |= c2numpy_write_groups(writer);
+    if (!writer->runSummaries.empty())
+        status |= c2numpy_sidecar(writer, "summary.json", c2numpy_summary_json(writer, writer->runSummaries, writer->rowsFinished));
+    if (writer->checksums)
+        status |= c2numpy_sidecar(writer, "checksums.txt", writer->checksumManifest);
+
+    // an Arrow IPC stream ends with an end-of-stream marker
+    if (writer->arrowIPC  &&  writer->sink.open == c2numpy_stream_open  &&  anyRows) {
+        static const char end[8] = {'\xff', '\xff', '\xff', '\xff', 0, 0, 0, 0};
+        C2NUMPY_STATS_COUNT(writeCalls, 1)
+        C2NUMPY_STATS_COUNT(bytes, 8)
+        status |= writer->sink.write(writer->sink.state, end, 8);
+    }
+
+    C2NUMPY_STATS_END(closeStart, closeTime)
+    return status;
+}
+
+//////////////////////////////////////////////////////////////// Arrow C Data Interface
+
+// https://arrow.apache.org/docs/format/CDataInterface.html (the guard lets other headers define them too)
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema*);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray*);
+    void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+// what an exported schema owns; children are released with their parent
+typedef struct {
+    std::deque<std::string> strings;
+    std::deque<struct ArrowSchema> nodes;
+    std::deque<std::vector<struct ArrowSchema*> > children;
+} c2numpy_arrow_schema_data;
+
+// what an exported array owns: its columns, copied out of the writer's buffer
+typedef struct {
+    std::deque<struct ArrowArray> nodes;
+    std::deque<std::vector<struct ArrowArray*> > children;
+    std::deque<std::vector<const void*> > buffers;
+    std::deque<std::vector<char> > columns;
+} c2numpy_arrow_array_data;
+
+void c2numpy_arrow_release_child_schema(struct ArrowSchema *schema) {
+    schema->release = NULL;
+}
+
+void c2numpy_arrow_release_child_array(struct ArrowArray *array) {
+    array->release = NULL;
+}
+
+void c2numpy_arrow_release_schema(struct ArrowSchema *schema) {
+    delete (c2numpy_arrow_schema_data*)schema->private_data;
+    schema->release = NULL;
+}
+
+void c2numpy_arrow_release_array(struct ArrowArray *array) {
+    delete (c2numpy_arrow_array_data*)array->private_data;
+    array->release = NULL;
+}
+
+inline struct ArrowSchema* c2numpy_arrow_schema_node(c2numpy_arrow_schema_data *data, struct ArrowSchema *node, const std::string &format, const std::string &name, int64_t numChildren) {
+    data->strings.push_back(format);
+    node->format = data->strings.back().c_str();
+    data->strings.push_back(name);
+    node->name = data->strings.back().c_str();
+    node->metadata = NULL;
+    node->flags = 0;
+    node->n_children = numChildren;
+    data->children.push_back(std::vector<struct ArrowSchema*>(numChildren));
+    node->children = numChildren > 0 ? &data->children.back()[0] : NULL;
+    node->dictionary = NULL;
+    node->release = c2numpy_arrow_release_child_schema;
+    node->private_data = NULL;
+    return node;
+}
+
+inline struct ArrowArray* c2numpy_arrow_array_node(c2numpy_arrow_array_data *data, struct ArrowArray *node, int64_t length, const void *values, int64_t numChildren) {
+    node->length = length;
+    node->null_count = 0;
+    node->offset = 0;
+    data->buffers.push_back(std::vector<const void*>());
+    data->buffers.back().push_back(NULL);   // no validity bitmap: nothing is null
+    if (values != NULL)
+        data->buffers.back().push_back(values);
+    node->n_buffers = data->buffers.back().size();
+    node->buffers = &data->buffers.back()[0];
+    node->n_children = numChildren;
+    data->children.push_back(std::vector<struct ArrowArray*>(numChildren));
+    node->children = numChildren > 0 ? &data->children.back()[0] : NULL;
+    node->dictionary = NULL;
+    node->release = c2numpy_arrow_release_child_array;
+    node->private_data = NULL;
+    return node;
+}
+
+// Export the rows staged in the writer's buffer (not yet handed to the sink) as an Arrow struct array
+// with one child per column, for Arrow tools in the same process. The buffer is row-major and Arrow is
+// columnar, so each column is copied once; there is no serialization. Call it at a row boundary,
+// before c2numpy_rotate or the next automatic flush, to see every row. Both structs belong to the
+// caller, who must call their release callbacks.
+int c2numpy_arrow(c2numpy_writer *writer, struct ArrowSchema *schema, struct ArrowArray *array) {
+    if (writer->currentColumn != 0) return -1;   // in the middle of a row
+
+    std::vector<size_t> itemSizes(writer->numColumns);
+    std::vector<std::string> formats(writer->numColumns);
+    std::vector<std::string> itemFormats(writer->numColumns);
+    size_t rowSize = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        const char *descr = c2numpy_descr(writer->columnTypes[column]);
+        itemSizes[column] = atoi(descr + 2);
+        formats[column] = c2numpy_arrow_format(descr, itemFormats[column]);
+        if (formats[column] == "") return -1;
+        rowSize += itemSizes[column];
+    }
+
+    // the header is in the buffer until the first flush of a file
+    size_t start = (writer->fileOpen  &&  writer->fileBytes == 0) ? writer->headerBytes : 0;
+    int64_t numRows = writer->bufferUsed > start ? (writer->bufferUsed - start) / rowSize : 0;
+    const char *rows = numRows > 0 ? &writer->buffer[start] : NULL;
+    int64_t firstRow = writer->currentRowInFile - numRows;   // of the current file, for the validity bitmaps
+
+    c2numpy_arrow_schema_data *schemaData = new c2numpy_arrow_schema_data;
+    c2numpy_arrow_array_data *arrayData = new c2numpy_arrow_array_data;
+    c2numpy_arrow_schema_node(schemaData, schema, "+s", "", writer->numColumns);
+    c2numpy_arrow_array_node(arrayData, array, numRows, NULL, writer->numColumns);
+
+    size_t offset = 0;
+    for (int32_t column = 0;  column < writer->numColumns;  ++column) {
+        size_t itemSize = itemSizes[column];
+        arrayData->columns.push_back(std::vector<char>());
+        std::vector<char> &values = arrayData->columns.back();
+
+        if (formats[column] == "b") {
+            // Arrow booleans are bits
+            values.resize((numRows + 7) / 8 + 1, 0);
+            for (int64_t row = 0;  row < numRows;  ++row)
+                if (rows[row * rowSize + offset])
+                    values[row / 8] |= (char)(1 << (row % 8));
+        }
+        else {
+            values.resize(numRows * itemSize + 1);
+            for (int64_t row = 0;  row < numRows;  ++row)
+                memcpy(&values[row * itemSize], &rows[row * rowSize + offset], itemSize);
+        }
+        offset += itemSize;
+
+        schemaData->nodes.push_back(ArrowSchema());
+        arrayData->nodes.push_back(ArrowArray());
+        struct ArrowSchema *childSchema = c2numpy_arrow_schema_node(schemaData, &schemaData->nodes.back(), formats[column], writer->columnNames[column], itemFormats[column] == "" ? 0 : 1);
+        struct ArrowArray *childArray;
+        if (itemFormats[column] == "")
+            childArray = c2numpy_arrow_array_node(arrayData, &arrayData->nodes.back(), numRows, &values[0], 0);
+        else {
+            // complex: a list of (real, imaginary) per row, with the floats as the list's child
+            childArray = c2numpy_arrow_array_node(arrayData, &arrayData->nodes.back(), numRows, NULL, 1);
+            schemaData->nodes.push_back(ArrowSchema());
+            arrayData->nodes.push_back(ArrowArray());
+            childSchema->children[0] = c2numpy_arrow_schema_node(schemaData, &schemaData->nodes.back(), itemFormats[column], "item", 0);
+            childArray->children[0] = c2numpy_arrow_array_node(arrayData, &arrayData->nodes.back(), 2 * numRows, &values[0], 0);
+        }
+        if (writer->nullCounts[column] >= 0) {
+            childSchema->flags |= ARROW_FLAG_NULLABLE;
+            arrayData->columns.push_back(std::vector<char>((numRows + 7) / 8 + 1));
+            std::vector<char> &valid = arrayData->columns.back();
+            childArray->null_count = c2numpy_validity(writer, column, firstRow, numRows, (uint8_t*)&valid[0]);
+            if (childArray->null_count > 0)
+                childArray->buffers[0] = &valid[0];
+        }
+        schema->children[column] = childSchema;
+        array->children[column] = childArray;
     }
 
+    schema->release = c2numpy_arrow_release_schema;
+    schema->private_data = schemaData;
+    array->release = c2numpy_arrow_release_array;
+    array->private_data = arrayData;
+    return 0;
+}
+
+#ifdef C2NUMPY_STATS
+const c2numpy_stats *c2numpy_getstats(const c2numpy_writer *writer) {
+    return &writer->stats;
+}
+
+int c2numpy_stats_callback(c2numpy_writer *writer, uint64_t everyRows, c2numpy_stats_function function, void *userData) {
+    if (function != NULL  &&  everyRows == 0) return -1;
+    writer->statsFunction = function;
+    writer->statsUserData = userData;
+    writer->statsEveryRows = everyRows;
     return 0;
 }
 
+void c2numpy_histogram_json(const c2numpy_histogram *histogram, FILE *out) {
+    fprintf(out, "{\"count\": %" PRIu64 ", \"totalNanoseconds\": %" PRIu64 ", \"maxNanoseconds\": %" PRIu64 ", \"log2Bins\": [",
+            histogram->count, histogram->totalNanoseconds, histogram->maxNanoseconds);
+    // trailing empty bins are left out
+    int numBins = C2NUMPY_STATS_BINS;
+    while (numBins > 0  &&  histogram->bins[numBins - 1] == 0)
+        numBins--;
+    for (int bin = 0;  bin < numBins;  ++bin)
+        fprintf(out, bin == 0 ? "%" PRIu64 : ", %" PRIu64, histogram->bins[bin]);
+    fprintf(out, "]}");
+}
+
+int c2numpy_stats_json(const c2numpy_stats *stats, FILE *out) {
+    fprintf(out, "{\"rows\": %" PRIu64 ", \"items\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"writeCalls\": %" PRIu64 ", \"filesOpened\": %" PRIu64 ", \"filesRotated\": %" PRIu64,
+            stats->rows, stats->items, stats->bytes, stats->writeCalls, stats->filesOpened, stats->filesRotated);
+    fprintf(out, ", \"writeTime\": ");
+    c2numpy_histogram_json(&stats->writeTime, out);
+    fprintf(out, ", \"openTime\": ");
+    c2numpy_histogram_json(&stats->openTime, out);
+    fprintf(out, ", \"rotateTime\": ");
+    c2numpy_histogram_json(&stats->rotateTime, out);
+    fprintf(out, ", \"closeTime\": ");
+    c2numpy_histogram_json(&stats->closeTime, out);
+    fprintf(out, "}\n");
+    return ferror(out) ? -1 : 0;
+}
+#endif // C2NUMPY_STATS
+
 #endif // C2NUMPY
@@ -0,0 +1,177 @@
+# Copyright 2016 Jim Pivarski
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Python helpers for the files and streams that c2numpy.h writes.
+
+import ast
+import json
+import os.path
+import struct
+
+import numpy
+
+def _readfully(stream, size):
+    chunks = []
+    while size > 0:
+        chunk = stream.read(size)
+        if not chunk:
+            break
+        chunks.append(chunk)
+        size -= len(chunk)
+    return b"".join(chunks)
+
+def iterchunks(stream):
+    """Iterate over the arrays in a stream of concatenated .npy chunks, as written by c2numpy_use_stream.
+
+    `stream` is a binary file-like object, such as `socket.makefile("rb")` or a pipe. Each chunk is
+    yielded as soon as it has fully arrived; iteration stops at the end of the stream."""
+    while True:
+        magic = _readfully(stream, 8)
+        if len(magic) == 0:
+            return
+        if len(magic) != 8 or magic[:6] != b"\x93NUMPY":
+            raise IOError("not a .npy chunk")
+
+        if magic[6:7] == b"\x01":
+            headerSize, = struct.unpack("<H", _readfully(stream, 2))
+        else:
+            headerSize, = struct.unpack("<I", _readfully(stream, 4))
+        header = ast.literal_eval(_readfully(stream, headerSize).decode("latin1"))
+
+        dtype = numpy.dtype(header["descr"])
+        shape = header["shape"]
+        size = dtype.itemsize * int(numpy.prod(shape))
+        data = _readfully(stream, size)
+        if len(data) != size:
+            raise IOError("stream ended in the middle of a chunk")
+
+        yield numpy.frombuffer(data, dtype=dtype).reshape(shape, order="F" if header["fortran_order"] else "C")
+
+def columns(prefix):
+    """Column names of a matrix-mode dataset (c2numpy_matrix), from <prefix>columns.txt."""
+    with open(prefix + "columns.txt") as file:
+        return file.read().split("\n")[:-1]
+
+def categories(prefix, column):
+    """Strings of a C2NUMPY_CATEGORY column, indexed by code, from <prefix><column>.categories.npy."""
+    return numpy.load(prefix + column + ".categories.npy")
+
+def categorical(prefix, column, codes):
+    """pandas.Categorical of a C2NUMPY_CATEGORY column, given its codes from any file of the dataset
+    (such as numpy.load(prefix + "0.npy")[column])."""
+    import pandas
+    return pandas.Categorical.from_codes(codes, categories(prefix, column).astype(str))
+
+def decode(prefix, data):
+    """Undo the write-time transforms of <prefix>transforms.txt (c2numpy_downcast, c2numpy_quantize,
+    c2numpy_truncate) on a record array from the dataset: transformed fields become float64 again."""
+    transformsName = prefix + "transforms.txt"
+    if data.dtype.names is None or not os.path.exists(transformsName):
+        return data
+    with open(transformsName) as file:
+        transforms = ast.literal_eval(file.read())
+
+    out = numpy.empty(data.shape, dtype=[(name, transforms[name]["dtype"] if name in transforms else data.dtype[name]) for name in data.dtype.names])
+    for name in data.dtype.names:
+        transform = transforms.get(name)
+        if transform is not None and transform["transform"] == "quantize":
+            out[name] = transform["offset"] + transform["scale"] * data[name]
+        else:
+            out[name] = data[name]
+    return out
+
+def load(prefix, number):
+    """File <prefix><number>.npy as a numpy.ma.MaskedArray, masking the nulls of nullable columns
+    (c2numpy_null), which are recorded in <prefix><number>.valid.npy if the file has any, and
+    undoing any write-time transforms (see decode)."""
+    data = decode(prefix, numpy.load("{0}{1}.npy".format(prefix, number)))
+    if data.dtype.names is None:
+        mask = numpy.zeros(data.shape, dtype=bool)        # matrix mode: names are in <prefix>columns.txt
+    else:
+        mask = numpy.zeros(data.shape, dtype=[(name, bool) for name in data.dtype.names])
+
+    validName = "{0}{1}.valid.npy".format(prefix, number)
+    if os.path.exists(validName):
+        valid = numpy.load(validName)
+        names = columns(prefix) if data.dtype.names is None else None
+        for name in valid.dtype.names:
+            isnull = numpy.unpackbits(valid[name], bitorder="little")[:len(data)] == 0
+            if names is None:
+                mask[name] = isnull
+            else:
+                mask[:, names.index(name)] = isnull
+    return numpy.ma.MaskedArray(data, mask=mask)
+
+def flagnames(prefix, column):
+    """Names of the bits of a c2numpy_addflags column, bit 0 first, from <prefix><column>.flags.txt."""
+    with open(prefix + column + ".flags.txt") as file:
+        return file.read().split("\n")[:-1]
+
+def flags(prefix, column, values):
+    """Unpack the values of a c2numpy_addflags column (such as numpy.load(prefix + "0.npy")[column]) into
+    a record array with a bool field per flag, all at once rather than bit by bit."""
+    names = flagnames(prefix, column)
+    values = numpy.ascontiguousarray(values, dtype=values.dtype.newbyteorder("<"))
+    bits = numpy.unpackbits(values.view(numpy.uint8).reshape(len(values), -1), axis=1, bitorder="little")
+    out = numpy.empty(len(values), dtype=[(name, bool) for name in names])
+    for bit, name in enumerate(names):
+        out[name] = bits[:, bit]
+    return out
+
+def keyranges(prefix):
+    """Each file's range of each sort key (c2numpy_sortby), from <prefix>keyranges.txt, as a record
+    array with fields number (the file number), <key>_min, <key>_max."""
+    return numpy.atleast_1d(numpy.genfromtxt(prefix + "keyranges.txt", names=True, dtype=None))
+
+def select(prefix, key, low, high):
+    """Numbers of the files that may have rows with low <= key <= high (key is a sort key)."""
+    ranges = keyranges(prefix)
+    return ranges["number"][(ranges[key + "_max"] >= low) & (ranges[key + "_min"] <= high)].tolist()
+
+def group(prefix, *key):
+    """Rows of the group with these keys (c2numpy_begin_group), or None if there is none: one binary search
+    in <prefix>groups.npy, then a slice of the memory-mapped file(s) it is in."""
+    groups = numpy.load(prefix + "groups.npy", mmap_mode="r")
+    names = groups.dtype.names[:-3]
+    low, high = 0, len(groups)
+    while low < high:
+        middle = (low + high) // 2
+        if tuple(groups[middle][name] for name in names) < key:
+            low = middle + 1
+        else:
+            high = middle
+    if low == len(groups) or tuple(groups[low][name] for name in names) != key:
+        return None
+
+    number, start, length = int(groups[low]["file"]), int(groups[low]["start"]), int(groups[low]["length"])
+    pieces = []
+    while True:
+        data = numpy.load("{0}{1}.npy".format(prefix, number), mmap_mode="r")
+        pieces.append(data[start:start + length])
+        length -= len(pieces[-1])
+        if length <= 0:
+            break
+        number, start = number + 1, 0
+    return pieces[0] if len(pieces) == 1 else numpy.concatenate(pieces)
+
+def summary(prefix, number=None):
+    """The c2numpy_summarize statistics of file number, or of the whole run if number is None, as a dict:
+    {"rows": ..., "columns": {name: {"count", "nulls", "nans", "mean", "variance", "min", "max", and for a
+    histogram "low", "high", "underflow", "overflow", "bins"}}}."""
+    if number is None:
+        fileName = prefix + "summary.json"
+    else:
+        fileName = "{0}{1}.summary.json".format(prefix, number)
+    with open(fileName) as file:
+        return json.load(file)
@@ -0,0 +1,152 @@
+// Copyright 2016 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Minimal readers for what c2numpy writes; not a general .npy parser.
+
+#ifndef C2NUMPY_READER
+#define C2NUMPY_READER
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// reads the sequence of .npy arrays written by c2numpy_use_stream, one chunk at a time
+typedef struct {
+    int fd;                       // input file descriptor (pipe, socket, file)
+    std::string header;           // header dict of the current chunk, as text
+    std::string descr;            // its 'descr' entry, as text
+    int fortranOrder;             // its 'fortran_order' entry
+    std::vector<int64_t> shape;   // its 'shape' entry
+    int64_t numRows;              // first dimension of the shape
+    int64_t rowSize;              // bytes per row: item size times any further dimensions
+    std::vector<char> data;       // numRows * rowSize bytes
+} c2numpy_reader;
+
+int c2numpy_reader_init(c2numpy_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->fortranOrder = 0;
+    reader->numRows = 0;
+    reader->rowSize = 0;
+    return 0;
+}
+
+// returns the number of bytes read, which is less than size only at the end of the stream
+inline int64_t c2numpy_read_fully(int fd, void *data, size_t size) {
+    char *bytes = (char*)data;
+    size_t total = 0;
+    while (total < size) {
+        ssize_t got = read(fd, bytes + total, size - total);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) break;
+        total += got;
+    }
+    return total;
+}
+
+// size in bytes of a Numpy type string such as "<f8", "|b1" or "|S12"
+inline int64_t c2numpy_descr_size(const std::string &type) {
+    if (type.size() < 3) return -1;
+    return atoll(type.c_str() + 2);
+}
+
+// item size of a 'descr' entry: either a quoted type string or a list of ('name', 'type') pairs
+inline int64_t c2numpy_parse_itemsize(const std::string &descr) {
+    std::vector<std::string> quoted;
+    size_t start = descr.find('\'');
+    while (start != std::string::npos) {
+        size_t stop = descr.find('\'', start + 1);
+        if (stop == std::string::npos) return -1;
+        quoted.push_back(descr.substr(start + 1, stop - start - 1));
+        start = descr.find('\'', stop + 1);
+    }
+
+    if (descr.size() > 0  &&  descr[0] != '[')
+        return quoted.size() == 1 ? c2numpy_descr_size(quoted[0]) : -1;
+
+    int64_t total = 0;
+    for (size_t i = 1;  i < quoted.size();  i += 2) {
+        int64_t size = c2numpy_descr_size(quoted[i]);
+        if (size < 0) return -1;
+        total += size;
+    }
+    return total;
+}
+
+inline int c2numpy_parse_header(c2numpy_reader *reader) {
+    const std::string &header = reader->header;
+
+    size_t descrStart = header.find("'descr': ");
+    size_t orderStart = header.find(", 'fortran_order': ");
+    size_t shapeStart = header.find("'shape': (");
+    if (descrStart == std::string::npos  ||  orderStart == std::string::npos  ||  shapeStart == std::string::npos)
+        return -1;
+    descrStart += strlen("'descr': ");
+    reader->descr = header.substr(descrStart, orderStart - descrStart);
+    reader->fortranOrder = header.compare(orderStart + strlen(", 'fortran_order': "), 4, "True") == 0;
+
+    reader->shape.clear();
+    const char *position = header.c_str() + shapeStart + strlen("'shape': (");
+    while (*position != ')'  &&  *position != 0) {
+        char *end;
+        int64_t dimension = strtoll(position, &end, 10);
+        if (end == position) return -1;
+        reader->shape.push_back(dimension);
+        position = end;
+        while (*position == ','  ||  *position == ' ') position++;
+    }
+    if (reader->shape.size() == 0) return -1;
+
+    int64_t itemSize = c2numpy_parse_itemsize(reader->descr);
+    if (itemSize < 0) return -1;
+    reader->numRows = reader->shape[0];
+    reader->rowSize = itemSize;
+    for (size_t i = 1;  i < reader->shape.size();  ++i)
+        reader->rowSize *= reader->shape[i];
+    return 0;
+}
+
+// read the next chunk: returns 1 if one was read, 0 at the end of the stream, and -1 on error
+int c2numpy_read_chunk(c2numpy_reader *reader) {
+    char magic[8];
+    int64_t got = c2numpy_read_fully(reader->fd, magic, 8);
+    if (got == 0) return 0;
+    if (got != 8  ||  memcmp(magic, "\x93NUMPY", 6) != 0) return -1;
+
+    uint32_t headerSize = 0;
+    if (magic[6] == 1) {
+        if (c2numpy_read_fully(reader->fd, &headerSize, 2) != 2) return -1;
+    }
+    else {
+        if (c2numpy_read_fully(reader->fd, &headerSize, 4) != 4) return -1;
+    }
+
+    reader->header.resize(headerSize);
+    if (c2numpy_read_fully(reader->fd, &reader->header[0], headerSize) != headerSize) return -1;
+    if (c2numpy_parse_header(reader) != 0) return -1;
+
+    int64_t dataSize = reader->numRows * reader->rowSize;
+    reader->data.resize(dataSize);
+    if (dataSize > 0  &&  c2numpy_read_fully(reader->fd, &reader->data[0], dataSize) != dataSize) return -1;
+    return 1;
+}
+
+#endif // C2NUMPY_READER
@@ -28,6 +28,7 @@
 #include "FWCore/Framework/interface/MakerMacros.h"
 
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/Utilities/interface/Exception.h"
 
 #include "DataFormats/TrackReco/interface/TrackFwd.h"
 #include "DataFormats/TrackReco/interface/Track.h"
@@ -109,20 +110,26 @@ DemoAnalyzer::DemoAnalyzer(const edm::ParameterSet& iConfig)
    tracksBlock = (NumpyCommonBlock*)iConfig.getParameter<unsigned long long>("tracks");
    hitsBlock   = (NumpyCommonBlock*)iConfig.getParameter<unsigned long long>("hits");
 
-   trackermu_qoverp     = tracksBlock->newAccessor<double>("trackermu_qoverp");
-   trackermu_qoverp_err = tracksBlock->newAccessor<double>("trackermu_qoverp_err");
-   trackermu_phi        = tracksBlock->newAccessor<double>("trackermu_phi");
-   trackermu_eta        = tracksBlock->newAccessor<double>("trackermu_eta");
-   trackermu_dxy        = tracksBlock->newAccessor<double>("trackermu_dxy");
-   trackermu_dz         = tracksBlock->newAccessor<double>("trackermu_dz");
-   globalmu_qoverp      = tracksBlock->newAccessor<double>("globalmu_qoverp");
-   globalmu_qoverp_err  = tracksBlock->newAccessor<double>("globalmu_qoverp_err");
-
-   detid      = hitsBlock->newAccessor<uint64_t>("detid");
-   localx     = hitsBlock->newAccessor<double>("localx");
-   localy     = hitsBlock->newAccessor<double>("localy");
-   localx_err = hitsBlock->newAccessor<double>("localx_err");
-   localy_err = hitsBlock->newAccessor<double>("localy_err");
+   // resolve all arrays up front, so that a mismatched Python configuration reports every problem at once
+   NumpyCommonBlockBinder tracksBinder(tracksBlock);
+   tracksBinder.bind("trackermu_qoverp",     trackermu_qoverp)
+               .bind("trackermu_qoverp_err", trackermu_qoverp_err)
+               .bind("trackermu_phi",        trackermu_phi)
+               .bind("trackermu_eta",        trackermu_eta)
+               .bind("trackermu_dxy",        trackermu_dxy)
+               .bind("trackermu_dz",         trackermu_dz)
+               .bind("globalmu_qoverp",      globalmu_qoverp)
+               .bind("globalmu_qoverp_err",  globalmu_qoverp_err);
+
+   NumpyCommonBlockBinder hitsBinder(hitsBlock);
+   hitsBinder.bind("detid",      detid)
+             .bind("localx",     localx)
+             .bind("localy",     localy)
+             .bind("localx_err", localx_err)
+             .bind("localy_err", localy_err);
+
+   if (!tracksBinder.ok()  ||  !hitsBinder.ok())
+     throw cms::Exception("DemoAnalyzer") << "tracks:\n" << tracksBinder.errors() << "hits:\n" << hitsBinder.errors();
 }
 
 
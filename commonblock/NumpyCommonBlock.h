@@ -12,162 +12,842 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef NUMPYCOMMONBLOCK
+#define NUMPYCOMMONBLOCK
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <inttypes.h>
-#include <typeinfo>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <algorithm>
+#include <complex>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 
 template <typename T> class NumpyCommonBlockAccessor;
+template <typename T> class NumpyCommonBlockReadGuard;
+template <typename T> class NumpyCommonBlockWriteGuard;
+class NumpyCommonBlockBinder;
+
+// Numpy dtypes as numbers, computed once by Python (commonblock._dtypecode) instead of compared as strings.
+enum {
+  NUMPYCOMMONBLOCK_OTHER = 0,
+  NUMPYCOMMONBLOCK_BOOL,
+  NUMPYCOMMONBLOCK_INT8,
+  NUMPYCOMMONBLOCK_UINT8,
+  NUMPYCOMMONBLOCK_INT16,
+  NUMPYCOMMONBLOCK_UINT16,
+  NUMPYCOMMONBLOCK_INT32,
+  NUMPYCOMMONBLOCK_UINT32,
+  NUMPYCOMMONBLOCK_INT64,
+  NUMPYCOMMONBLOCK_UINT64,
+  NUMPYCOMMONBLOCK_FLOAT32,
+  NUMPYCOMMONBLOCK_FLOAT64,
+  NUMPYCOMMONBLOCK_COMPLEX64,
+  NUMPYCOMMONBLOCK_COMPLEX128,
+  NUMPYCOMMONBLOCK_STRING,      // "|S<N>": NumpyCommonBlockString<N>
+  NUMPYCOMMONBLOCK_RECORD       // structured: a struct declared with NUMPYCOMMONBLOCK_RECORD_TYPE
+};
+
+// Whether C++ type T can view items of a given dtype code and size. Only the types declared below
+// can: the numbers, NumpyCommonBlockString<N> and structs declared with NUMPYCOMMONBLOCK_RECORD_TYPE.
+template <typename T> struct NumpyCommonBlockDtype {
+  static inline bool matches(uint32_t /* code */, uint64_t /* itemsize */) {
+    return false;
+  }
+};
+
+#define NUMPYCOMMONBLOCK_DTYPE(T, CODE)                                    \
+  template <> struct NumpyCommonBlockDtype<T> {                            \
+    static inline bool matches(uint32_t code, uint64_t /* itemsize */) {   \
+      return code == CODE;                                                 \
+    }                                                                      \
+  };
+
+NUMPYCOMMONBLOCK_DTYPE(bool, NUMPYCOMMONBLOCK_BOOL)
+NUMPYCOMMONBLOCK_DTYPE(int8_t, NUMPYCOMMONBLOCK_INT8)
+NUMPYCOMMONBLOCK_DTYPE(uint8_t, NUMPYCOMMONBLOCK_UINT8)
+NUMPYCOMMONBLOCK_DTYPE(int16_t, NUMPYCOMMONBLOCK_INT16)
+NUMPYCOMMONBLOCK_DTYPE(uint16_t, NUMPYCOMMONBLOCK_UINT16)
+NUMPYCOMMONBLOCK_DTYPE(int32_t, NUMPYCOMMONBLOCK_INT32)
+NUMPYCOMMONBLOCK_DTYPE(uint32_t, NUMPYCOMMONBLOCK_UINT32)
+NUMPYCOMMONBLOCK_DTYPE(int64_t, NUMPYCOMMONBLOCK_INT64)
+NUMPYCOMMONBLOCK_DTYPE(uint64_t, NUMPYCOMMONBLOCK_UINT64)
+NUMPYCOMMONBLOCK_DTYPE(float, NUMPYCOMMONBLOCK_FLOAT32)
+NUMPYCOMMONBLOCK_DTYPE(double, NUMPYCOMMONBLOCK_FLOAT64)
+NUMPYCOMMONBLOCK_DTYPE(std::complex<float>, NUMPYCOMMONBLOCK_COMPLEX64)
+NUMPYCOMMONBLOCK_DTYPE(std::complex<double>, NUMPYCOMMONBLOCK_COMPLEX128)
+
+// An item of a fixed-width string array (numpy "|S<N>"): padded with zeros, not terminated if it fills all N bytes.
+template <size_t N> struct NumpyCommonBlockString {
+  char chars[N];
+
+  inline std::string str() const {
+    return std::string(chars, strnlen(chars, N));
+  }
+
+  inline void assign(const std::string &value) {
+    memset(chars, 0, N);
+    memcpy(chars, value.data(), std::min(value.size(), N));
+  }
+};
+
+template <size_t N> struct NumpyCommonBlockDtype<NumpyCommonBlockString<N> > {
+  static inline bool matches(uint32_t code, uint64_t itemsize) {
+    return code == NUMPYCOMMONBLOCK_STRING  &&  itemsize == N;
+  }
+};
+
+// Lets a struct with the same layout as a structured dtype (a plain C struct, if the dtype was made
+// with align=True) view its items; declare it at global scope. Only the size can be checked.
+#define NUMPYCOMMONBLOCK_RECORD_TYPE(T)                                    \
+  template <> struct NumpyCommonBlockDtype<T> {                            \
+    static inline bool matches(uint32_t code, uint64_t itemsize) {         \
+      return code == NUMPYCOMMONBLOCK_RECORD  &&  itemsize == sizeof(T);   \
+    }                                                                      \
+  };
+
+// Layout of a shared-memory segment (NumpyCommonBlock.shared in Python). Everything is found by byte
+// offsets from the start of the segment, since each process maps it at a different address.
+#define NUMPYCOMMONBLOCK_MAGIC "NPCBSHM1"
+#define NUMPYCOMMONBLOCK_MAXDIMS 8
+
+struct NumpyCommonBlockSharedArray {
+  char name[64];
+  char type[256];               // numpy dtype as text; structured dtypes can be long
+  uint64_t length;              // items per slot (capacity)
+  uint64_t dataOffset;
+  uint64_t lockOffset;          // process-shared pthread_rwlock_t
+  uint64_t itemsize;
+  uint64_t ndim;
+  uint64_t shape[NUMPYCOMMONBLOCK_MAXDIMS];     // of one slot, C order
+  int64_t strides[NUMPYCOMMONBLOCK_MAXDIMS];
+  uint32_t dtype;               // NUMPYCOMMONBLOCK_* code
+  uint32_t padding;
+};
+
+struct NumpyCommonBlockShared {
+  char magic[8];                // written last by the creator, so a half-built segment isn't attached
+  uint64_t segmentSize;
+  uint64_t numArrays;
+  uint64_t numSlots;
+  uint64_t state;
+  uint32_t futex;
+  uint32_t seqlock;             // nonzero if seqlock mode is on
+  uint64_t writeCursor;
+  uint64_t readCursor;
+  uint64_t statelockOffset;
+  uint64_t slotStatesOffset;    // numSlots uint32_t
+  uint64_t seqsOffset;          // numArrays uint64_t
+  uint64_t arraysOffset;        // numArrays NumpyCommonBlockSharedArray
+  uint64_t countsOffset;        // numArrays * numSlots uint64_t live lengths
+};
 
 class NumpyCommonBlock {
   template <typename> friend class NumpyCommonBlockAccessor;
+  friend class NumpyCommonBlockBinder;
+  friend class NumpyCommonBlockWriter;
+  friend class NumpyCommonBlockArrow;
 
 public:
-  template <typename T> NumpyCommonBlockAccessor<T> accessor(std::string name) {
-    uint64_t which = 0;
-    while (which < numArrays) {
-      if (std::string(names[which]) == name)
-        break;
-      which++;
-    };
-    assert(which < numArrays);
+  // slot selects one of the copies of a pipelined block (see acquire_for_write)
+  template <typename T> NumpyCommonBlockAccessor<T> accessor(const std::string &name, uint64_t slot = 0) {
+    int64_t which = lookup(name);
+    assert(which >= 0);
+    return NumpyCommonBlockAccessor<T>(this, which, slot);
+  }
 
-    return NumpyCommonBlockAccessor<T>(this, which);
+  template <typename T> NumpyCommonBlockAccessor<T>* newAccessor(const std::string &name, uint64_t slot = 0) {
+    int64_t which = lookup(name);
+    assert(which >= 0);
+    return new NumpyCommonBlockAccessor<T>(this, which, slot);
   }
 
-  template <typename T> NumpyCommonBlockAccessor<T>* newAccessor(std::string name) {
-    uint64_t which = 0;
-    while (which < numArrays) {
-      if (std::string(names[which]) == name)
-        break;
-      which++;
-    };
-    assert(which < numArrays);
+  // position of the named array, or -1; the hash table is built on first use (or by attach)
+  inline int64_t lookup(const std::string &name) {
+    const std::unordered_map<std::string, uint64_t> *table = nameindex();
+    std::unordered_map<std::string, uint64_t>::const_iterator found = table->find(name);
+    return found == table->end() ? -1 : (int64_t)found->second;
+  }
 
-    return new NumpyCommonBlockAccessor<T>(this, which);
+  inline uint64_t size() {
+    return numArrays;
   }
 
-  inline void wait(uint64_t forstate) {
-    while (pthread_rwlock_rdlock(statelock) != 0) usleep(1);
-    uint64_t current = state;
-    pthread_rwlock_unlock(statelock);
+  inline const char* name(uint64_t which) {
+    assert(which < numArrays);
+    return names[which];
+  }
 
-    while (current != forstate) {
-      usleep(1);
-      while (pthread_rwlock_rdlock(statelock) != 0) usleep(1);
-      current = state;
-      pthread_rwlock_unlock(statelock);
-    }
+  inline const char* type(uint64_t which) {
+    assert(which < numArrays);
+    return types[which];
   }
 
-  inline void waitmask(uint64_t formask) {
-    while (pthread_rwlock_rdlock(statelock) != 0) usleep(1);
-    uint64_t current = state;
-    pthread_rwlock_unlock(statelock);
+  // Block until state == forstate (or timeout seconds pass, if timeout >= 0); returns false on timeout.
+  inline bool wait(uint64_t forstate, double timeout = -1) {
+    return waituntil(forstate, 0, false, timeout);
+  }
 
-    while (!(current & formask)) {
-      usleep(1);
-      while (pthread_rwlock_rdlock(statelock) != 0) usleep(1);
-      current = state;
-      pthread_rwlock_unlock(statelock);
-    }
+  // Block until state & formask is nonzero (or timeout seconds pass, if timeout >= 0); returns false on timeout.
+  inline bool waitmask(uint64_t formask, double timeout = -1) {
+    return waituntil(0, formask, true, timeout);
   }
 
   inline void notify(uint64_t newstate) {
     while (pthread_rwlock_wrlock(statelock) != 0) usleep(1);
-    state = newstate;
+    __atomic_store_n(statep(), newstate, __ATOMIC_SEQ_CST);
+    // every change of state changes the futex word, so a waiter can't miss it between checking and sleeping
+    __atomic_add_fetch(futexp(), 1, __ATOMIC_SEQ_CST);
     pthread_rwlock_unlock(statelock);
+    futexwake(futexp());
+  }
+
+  // Attach to a block that another process created with NumpyCommonBlock.shared(name, ...) in Python.
+  // Returns NULL (with errno set) if there is no such segment or it isn't finished yet. The two processes
+  // share arrays, locks, state and slots exactly as threads do with pointer(); free it with detach.
+  static NumpyCommonBlock* attach(const char *name) {
+    std::string shmName = std::string("/") + name;
+    int fd = shm_open(shmName.c_str(), O_RDWR, 0);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0  ||  info.st_size < (off_t)sizeof(NumpyCommonBlockShared)) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+    }
+    void *base = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    NumpyCommonBlockShared *header = (NumpyCommonBlockShared*)base;
+    if (memcmp(header->magic, NUMPYCOMMONBLOCK_MAGIC, 8) != 0  ||  header->segmentSize != (uint64_t)info.st_size) {
+      munmap(base, info.st_size);
+      errno = EAGAIN;
+      return NULL;
+    }
+
+    char *bytes = (char*)base;
+    NumpyCommonBlockSharedArray *arrays = (NumpyCommonBlockSharedArray*)(bytes + header->arraysOffset);
+    NumpyCommonBlock *out = new NumpyCommonBlock();
+    out->numArrays = header->numArrays;
+    out->names = new char*[out->numArrays];
+    out->types = new char*[out->numArrays];
+    out->data = new void*[out->numArrays];
+    out->lengths = new uint64_t[out->numArrays];
+    out->locks = new pthread_rwlock_t*[out->numArrays];
+    out->itemsizes = new uint64_t[out->numArrays];
+    out->ndims = new uint64_t[out->numArrays];
+    out->shapes = new uint64_t*[out->numArrays];
+    out->strides = new int64_t*[out->numArrays];
+    out->dtypes = new uint32_t[out->numArrays];
+    for (uint64_t i = 0;  i < out->numArrays;  ++i) {
+      out->names[i] = arrays[i].name;
+      out->types[i] = arrays[i].type;
+      out->data[i] = bytes + arrays[i].dataOffset;
+      out->lengths[i] = arrays[i].length;
+      out->locks[i] = (pthread_rwlock_t*)(bytes + arrays[i].lockOffset);
+      out->itemsizes[i] = arrays[i].itemsize;
+      out->ndims[i] = arrays[i].ndim;
+      out->shapes[i] = arrays[i].shape;
+      out->strides[i] = arrays[i].strides;
+      out->dtypes[i] = arrays[i].dtype;
+    }
+    out->statelock = (pthread_rwlock_t*)(bytes + header->statelockOffset);
+    out->state = 0;
+    out->futex = 0;
+    out->seqs = header->seqlock ? (uint64_t*)(bytes + header->seqsOffset) : NULL;
+    out->numSlots = header->numSlots;
+    out->slotStates = (uint32_t*)(bytes + header->slotStatesOffset);
+    out->writeCursor = 0;
+    out->readCursor = 0;
+    out->shared = header;
+    out->index = NULL;
+    out->counts = (uint64_t*)(bytes + header->countsOffset);
+    out->generation = 0;
+    out->grow = NULL;           // the segment has a fixed size
+    out->nameindex();
+    return out;
+  }
+
+  static void detach(NumpyCommonBlock *block) {
+    assert(block->shared != NULL);
+    munmap(block->shared, block->shared->segmentSize);
+    delete [] block->names;
+    delete [] block->types;
+    delete [] block->data;
+    delete [] block->lengths;
+    delete [] block->locks;
+    delete [] block->itemsizes;
+    delete [] block->ndims;
+    delete [] block->shapes;
+    delete [] block->strides;
+    delete [] block->dtypes;
+    delete (std::unordered_map<std::string, uint64_t>*)block->index;
+    delete block;
+  }
+
+  // The counterpart of detach for a block made in Python, which Python frees: frees what C++ added to
+  // it (the name index), once no thread is using it from C++. Without it, the block keeps the index
+  // until the process ends. If the block is used again, the index is rebuilt.
+  static void forget(NumpyCommonBlock *block) {
+    assert(block->shared == NULL);
+    void *table = __atomic_exchange_n(&block->index, (void*)NULL, __ATOMIC_ACQ_REL);
+    delete (std::unordered_map<std::string, uint64_t>*)table;
+  }
+
+  // Pipelined blocks (NumpyCommonBlock.pipelined in Python) have numSlots copies of every array, so that
+  // one side can fill a batch while the other consumes the previous one. There is one producer and one
+  // consumer; each slot goes FREE -> WRITING -> READY -> READING -> FREE, in order around the ring:
+  //
+  //     int64_t slot = block->acquire_for_write();      // waits for a FREE slot
+  //     ... fill block->accessor<double>("x", slot) ...
+  //     block->publish(slot);                           // consumer's acquire_for_read returns it
+  //
+  // The acquire functions return -1 if timeout seconds (if >= 0) pass first.
+
+  enum { SLOT_FREE = 0, SLOT_WRITING = 1, SLOT_READY = 2, SLOT_READING = 3 };
+
+  inline uint64_t slots() {
+    return numSlots;
+  }
+
+  inline int64_t acquire_for_write(double timeout = -1) {
+    uint64_t slot = *writecursorp() % numSlots;
+    if (!waitslot(slot, SLOT_FREE, timeout)) return -1;
+    __atomic_store_n(&slotStates[slot], (uint32_t)SLOT_WRITING, __ATOMIC_RELEASE);
+    (*writecursorp())++;
+    return slot;
+  }
+
+  inline void publish(uint64_t slot) {
+    assert(slotStates[slot] == SLOT_WRITING);
+    __atomic_store_n(&slotStates[slot], (uint32_t)SLOT_READY, __ATOMIC_SEQ_CST);
+    futexwake(&slotStates[slot]);
+  }
+
+  inline int64_t acquire_for_read(double timeout = -1) {
+    uint64_t slot = *readcursorp() % numSlots;
+    if (!waitslot(slot, SLOT_READY, timeout)) return -1;
+    __atomic_store_n(&slotStates[slot], (uint32_t)SLOT_READING, __ATOMIC_RELEASE);
+    (*readcursorp())++;
+    return slot;
+  }
+
+  inline void release(uint64_t slot) {
+    assert(slotStates[slot] == SLOT_READING);
+    __atomic_store_n(&slotStates[slot], (uint32_t)SLOT_FREE, __ATOMIC_SEQ_CST);
+    futexwake(&slotStates[slot]);
   }
 
 private:
   NumpyCommonBlock() { }   // can't create them
+
+  // Built once per block by whichever thread gets there first; owned by the block, and freed by
+  // detach (shared memory) or forget (made in Python).
+  inline const std::unordered_map<std::string, uint64_t>* nameindex() {
+    void *table = __atomic_load_n(&index, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+      std::unordered_map<std::string, uint64_t> *built = new std::unordered_map<std::string, uint64_t>();
+      built->reserve(numArrays);
+      for (uint64_t which = 0;  which < numArrays;  ++which)
+        built->insert(std::make_pair(std::string(names[which]), which));
+      if (__atomic_compare_exchange_n(&index, &table, (void*)built, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        table = built;
+      else
+        delete built;
+    }
+    return (const std::unordered_map<std::string, uint64_t>*)table;
+  }
+
+  // in a shared-memory block, the words that change live in the segment, not in this process's view of it
+  inline uint64_t* statep() { return shared == NULL ? &state : &shared->state; }
+  inline uint32_t* futexp() { return shared == NULL ? &futex : &shared->futex; }
+  inline uint64_t* writecursorp() { return shared == NULL ? &writeCursor : &shared->writeCursor; }
+  inline uint64_t* readcursorp() { return shared == NULL ? &readCursor : &shared->readCursor; }
+
+  static inline void deadlineafter(double timeout, struct timespec *deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += (time_t)timeout;
+    deadline->tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec += 1;
+      deadline->tv_nsec -= 1000000000L;
+    }
+  }
+
+  // false if the deadline has passed
+  static inline bool timeleft(const struct timespec *deadline, struct timespec *remaining) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remaining->tv_nsec < 0) {
+      remaining->tv_sec -= 1;
+      remaining->tv_nsec += 1000000000L;
+    }
+    return remaining->tv_sec >= 0;
+  }
+
+  // sleeps only if *word is still "seen" (so a change between checking and sleeping isn't missed)
+  static inline void futexwait(uint32_t *word, uint32_t seen, const struct timespec *remaining) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, remaining, NULL, 0);
+#else
+    usleep(1);
+#endif
+  }
+
+  static inline void futexwake(uint32_t *word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+  }
+
+  // until state == forstate, or if masked, until state & formask is nonzero
+  inline bool waituntil(uint64_t forstate, uint64_t formask, bool masked, double timeout) {
+    struct timespec deadline, remaining;
+    if (timeout >= 0) deadlineafter(timeout, &deadline);
+
+    while (true) {
+      uint32_t seen = __atomic_load_n(futexp(), __ATOMIC_SEQ_CST);
+      uint64_t current = __atomic_load_n(statep(), __ATOMIC_SEQ_CST);
+      if (masked ? (current & formask) != 0 : current == forstate)
+        return true;
+      if (timeout >= 0  &&  !timeleft(&deadline, &remaining))
+        return false;
+      futexwait(futexp(), seen, timeout >= 0 ? &remaining : NULL);
+    }
+  }
+
+  // the slot state word is its own futex: it changes on every transition
+  inline bool waitslot(uint64_t slot, uint32_t forstate, double timeout) {
+    struct timespec deadline, remaining;
+    if (timeout >= 0) deadlineafter(timeout, &deadline);
+
+    while (true) {
+      uint32_t seen = __atomic_load_n(&slotStates[slot], __ATOMIC_ACQUIRE);
+      if (seen == forstate)
+        return true;
+      if (timeout >= 0  &&  !timeleft(&deadline, &remaining))
+        return false;
+      futexwait(&slotStates[slot], seen, timeout >= 0 ? &remaining : NULL);
+    }
+  }
+
   uint64_t numArrays;
   char **names;
   char **types;
   void **data;
-  uint64_t *lengths;
+  uint64_t *lengths;            // capacity of each array (per slot)
   pthread_rwlock_t **locks;
   pthread_rwlock_t *statelock;
   uint64_t state;
+  uint32_t futex;               // incremented by every notify; waiters sleep on it
+  uint64_t *seqs;               // per-array sequence numbers (odd while being written), or NULL if seqlock mode is off
+  uint64_t numSlots;            // copies of each array (1 unless pipelined); slot k starts k * length items after data
+  uint32_t *slotStates;         // SLOT_FREE, SLOT_WRITING, SLOT_READY or SLOT_READING for each slot
+  uint64_t writeCursor;         // number of slots acquired by the producer so far
+  uint64_t readCursor;          // number of slots acquired by the consumer so far
+  NumpyCommonBlockShared *shared;   // start of the mapped segment if attached to shared memory, else NULL
+  uint64_t *counts;             // live length of each array in each slot: counts[which * numSlots + slot]
+  uint64_t generation;          // incremented whenever grow has moved an array
+  int (*grow)(NumpyCommonBlock *block, uint64_t which, uint64_t capacity);   // reallocates data[which] and sets lengths[which], or NULL
+  uint64_t *itemsizes;          // bytes per item of each array
+  uint64_t *ndims;              // dimensions of each array (of one slot)
+  uint64_t **shapes;            // shapes[which][0] is the capacity along the first dimension
+  int64_t **strides;            // in bytes, as in numpy
+  uint32_t *dtypes;             // NUMPYCOMMONBLOCK_* code of each array
+  void *index;                  // name -> position hash table (C++ only; NULL until first lookup)
 };
 
-template <typename T> class NumpyCommonBlockAccessor {
+// A pointer and a length (like std::span), for loops over a whole array while a guard holds its lock.
+template <typename T> class NumpyCommonBlockSpan {
 public:
-  NumpyCommonBlockAccessor(NumpyCommonBlock *cb, uint64_t which) {
-    std::string type = std::string(cb->types[which]);
-
-    if (type == std::string("bool"))
-      assert(typeid(T) == typeid(bool));
-
-    else if (type == std::string("int8"))
-      assert(typeid(T) == typeid(int8_t));
-
-    else if (type == std::string("uint8"))
-      assert(typeid(T) == typeid(uint8_t));
-
-    else if (type == std::string("int16"))
-      assert(typeid(T) == typeid(int16_t));
-
-    else if (type == std::string("uint16"))
-      assert(typeid(T) == typeid(uint16_t));
-
-    else if (type == std::string("int32"))
-      assert(typeid(T) == typeid(int32_t));
-
-    else if (type == std::string("uint32"))
-      assert(typeid(T) == typeid(uint32_t));
+  NumpyCommonBlockSpan(T *data, uint64_t length): data_(data), length_(length) { }
 
-    else if (type == std::string("int64"))
-      assert(typeid(T) == typeid(int64_t));
+  inline T& operator[](uint64_t index) const { return data_[index]; }
+  inline T* data() const { return data_; }
+  inline T* begin() const { return data_; }
+  inline T* end() const { return data_ + length_; }
+  inline uint64_t size() const { return length_; }
 
-    else if (type == std::string("uint64"))
-      assert(typeid(T) == typeid(uint64_t));
-
-    else if (type == std::string("float32"))
-      assert(typeid(T) == typeid(float));
+private:
+  T *data_;
+  uint64_t length_;
+};
 
-    else if (type == std::string("float64"))
-      assert(typeid(T) == typeid(double));
+template <typename T> class NumpyCommonBlockAccessor {
+  template <typename> friend class NumpyCommonBlockReadGuard;
+  template <typename> friend class NumpyCommonBlockWriteGuard;
 
-    else
-      assert(false);
+public:
+  NumpyCommonBlockAccessor(NumpyCommonBlock *cb, uint64_t which, uint64_t slot = 0) {
+    assert(NumpyCommonBlockDtype<T>::matches(cb->dtypes[which], cb->itemsizes[which]));
 
+    assert(slot < cb->numSlots);
+    block = cb;
+    this->which = which;
+    this->slot = slot;
     lock = cb->locks[which];
-    data = (T*)(cb->data[which]);
-    length = cb->lengths[which];
+    seq = cb->seqs == NULL ? NULL : &cb->seqs[which];
+    reload();
   }
 
   inline T get(uint64_t index) {
-    assert(index < length);
+    refresh();
+    assert(index < *count);
     return data[index];
   }
 
   inline void set(uint64_t index, T value) {
+    refresh();
     data[index] = value;
   }
 
   inline T safeget(uint64_t index) {
-    assert(index < length);
     while (pthread_rwlock_rdlock(lock) != 0) usleep(1);
+    refresh();
+    assert(index < *count);
     T out = data[index];
     pthread_rwlock_unlock(lock);
     return out;
   }
 
   inline void safeset(uint64_t index, T value) {
-    assert(index < length);
     while (pthread_rwlock_wrlock(lock) != 0) usleep(1);
+    refresh();
+    assert(index < *count);
+    beginwrite();
     data[index] = value;
+    endwrite();
+    pthread_rwlock_unlock(lock);
+  }
+
+  // In seqlock mode (NumpyCommonBlock.seqlock() in Python), every locked write also makes the array's
+  // sequence number odd while it lasts, so readers can copy without locking and retry if it changed.
+  // Call these around unlocked writes (set) too, if optimistic readers might be looking.
+
+  inline void beginwrite() {
+    if (seq != NULL) {
+      __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+  }
+
+  inline void endwrite() {
+    if (seq != NULL)
+      __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+  }
+
+  // Copy n elements without taking the lock, retrying while a write is in progress or happened during
+  // the copy; gives up (returning false) after maxRetries retries, if maxRetries >= 0. Also returns
+  // false if the elements are past the live length, but only once a consistent look says so: a
+  // concurrent resize is retried like any other write. Without seqlock mode, this is safecopy_out.
+  inline bool optimistic_copy_out(uint64_t begin, T *destination, uint64_t n, int64_t maxRetries = -1) {
+    if (seq == NULL) {
+      safecopy_out(begin, destination, n);
+      return true;
+    }
+    for (int64_t attempt = 0;  maxRetries < 0  ||  attempt <= maxRetries;  ++attempt) {
+      if (attempt >= 16) usleep(1);   // back off once spinning hasn't helped
+      uint64_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+      if (before & 1) continue;
+      refresh();
+      bool inrange = begin + n <= __atomic_load_n(count, __ATOMIC_ACQUIRE);
+      if (inrange)
+        memcpy(destination, data + begin, n * sizeof(T));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+        return inrange;
+    }
+    return false;
+  }
+
+  inline T optimistic_get(uint64_t index) {
+    T out = T();
+    bool copied = optimistic_copy_out(index, &out, 1);
+    assert(copied);
+    (void)copied;
+    return out;
+  }
+
+  // Range operations take the lock once for all n elements.
+
+  inline void safecopy_in(uint64_t begin, const T *source, uint64_t n) {
+    while (pthread_rwlock_wrlock(lock) != 0) usleep(1);
+    refresh();
+    assert(begin + n <= *count);
+    beginwrite();
+    memcpy(data + begin, source, n * sizeof(T));
+    endwrite();
+    pthread_rwlock_unlock(lock);
+  }
+
+  inline void safecopy_out(uint64_t begin, T *destination, uint64_t n) {
+    while (pthread_rwlock_rdlock(lock) != 0) usleep(1);
+    refresh();
+    assert(begin + n <= *count);
+    memcpy(destination, data + begin, n * sizeof(T));
+    pthread_rwlock_unlock(lock);
+  }
+
+  inline void fill(uint64_t begin, uint64_t n, T value) {
+    while (pthread_rwlock_wrlock(lock) != 0) usleep(1);
+    refresh();
+    assert(begin + n <= *count);
+    beginwrite();
+    std::fill(data + begin, data + begin + n, value);
+    endwrite();
     pthread_rwlock_unlock(lock);
   }
 
+  // Multidimensional arrays: element (i, j, ...) by the array's strides, so that any numpy layout
+  // (C order, Fortran order, a column of a larger array) is shared without copying. Unlocked, like
+  // get/set; the flat functions above see the items in memory order.
+
+  inline uint64_t ndim() {
+    return block->ndims[which];
+  }
+
+  // the first dimension is the live length (see resize)
+  inline uint64_t shape(uint64_t dimension) {
+    refresh();
+    assert(dimension < block->ndims[which]);
+    return dimension == 0 ? size() : block->shapes[which][dimension];
+  }
+
+  inline int64_t stride(uint64_t dimension) {
+    refresh();
+    assert(dimension < block->ndims[which]);
+    return block->strides[which][dimension];
+  }
+
+  inline T& operator()(uint64_t i) {
+    refresh();
+    assert(block->ndims[which] == 1  &&  i < size());
+    return *(T*)((char*)data + i*block->strides[which][0]);
+  }
+
+  inline T& operator()(uint64_t i, uint64_t j) {
+    refresh();
+    const int64_t *strides = block->strides[which];
+    assert(block->ndims[which] == 2  &&  i < size()  &&  j < block->shapes[which][1]);
+    return *(T*)((char*)data + i*strides[0] + j*strides[1]);
+  }
+
+  inline T& operator()(uint64_t i, uint64_t j, uint64_t k) {
+    refresh();
+    const int64_t *strides = block->strides[which];
+    assert(block->ndims[which] == 3  &&  i < size()  &&  j < block->shapes[which][1]  &&  k < block->shapes[which][2]);
+    return *(T*)((char*)data + i*strides[0] + j*strides[1] + k*strides[2]);
+  }
+
+  inline T& operator()(uint64_t i, uint64_t j, uint64_t k, uint64_t l) {
+    refresh();
+    const int64_t *strides = block->strides[which];
+    assert(block->ndims[which] == 4  &&  i < size()  &&  j < block->shapes[which][1]  &&  k < block->shapes[which][2]  &&  l < block->shapes[which][3]);
+    return *(T*)((char*)data + i*strides[0] + j*strides[1] + k*strides[2] + l*strides[3]);
+  }
+
+  // Each array has a capacity (its allocated size) and a live length, which starts out equal to the
+  // capacity, both counted along the first dimension (items for a 1-D array, rows for a 2-D one).
+  // Set the live length for each event with resize; past the capacity, the array is reallocated by
+  // the block's grow function (Python-owned blocks), to the larger of n and twice the capacity,
+  // keeping the live items. Returns false if it can't grow (shared-memory blocks can't). In a
+  // pipelined block, every slot moves; a consumer that holds a slot keeps reading the old copy. An old
+  // copy is freed at a later grow once no slot is held, so an unlocked reader (get, optimistic_get)
+  // must not still be inside one access across two grows.
+
+  inline bool resize(uint64_t n) {
+    while (pthread_rwlock_wrlock(lock) != 0) usleep(1);
+    refresh();
+    bool out = true;
+    beginwrite();
+    if (n * rowsize > length)
+      out = growto(std::max(n * rowsize, 2 * length));
+    if (out)
+      __atomic_store_n(count, n * rowsize, __ATOMIC_RELEASE);
+    endwrite();
+    pthread_rwlock_unlock(lock);
+    return out;
+  }
+
+  // unlocked, like set: appends to the live items of a 1-D array, growing if necessary
+  inline bool push_back(T value) {
+    refresh();
+    assert(rowsize == 1);
+    uint64_t n = *count;
+    if (n == length  &&  !resize(n + 1))
+      return false;
+    data[n] = value;
+    __atomic_store_n(count, n + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  inline void clear() {
+    resize(0);
+  }
+
+  // live length
   inline uint64_t size() {
-    return length;
+    refresh();
+    return __atomic_load_n(count, __ATOMIC_ACQUIRE) / rowsize;
+  }
+
+  inline uint64_t capacity() {
+    refresh();
+    return length / rowsize;
   }
 
 private:
+  // re-read the array's location if any array of the block has been reallocated since the last look
+  inline void refresh() {
+    if (__builtin_expect(__atomic_load_n(&block->generation, __ATOMIC_ACQUIRE) != generation, 0))
+      reload();
+  }
+
+  inline void reload() {
+    generation = __atomic_load_n(&block->generation, __ATOMIC_ACQUIRE);
+    length = block->lengths[which];
+    data = (T*)(block->data[which]) + slot * length;
+    count = &block->counts[which * block->numSlots + slot];
+    rowsize = 1;
+    for (uint64_t dimension = 1;  dimension < block->ndims[which];  ++dimension)
+      rowsize *= block->shapes[which][dimension];
+  }
+
+  // called with the write lock held
+  inline bool growto(uint64_t newLength) {
+    if (block->grow == NULL  ||  !block->grow(block, which, newLength))
+      return false;
+    __atomic_add_fetch(&block->generation, 1, __ATOMIC_RELEASE);
+    reload();
+    return true;
+  }
+
+  NumpyCommonBlock *block;
+  uint64_t which;
+  uint64_t slot;
   pthread_rwlock_t *lock;
   T *data;
-  uint64_t length;
+  uint64_t length;              // capacity of one slot
+  uint64_t *count;              // live length in items
+  uint64_t rowsize;             // items per entry of the first dimension
+  uint64_t generation;          // block->generation when data and length were read
+  uint64_t *seq;
+};
+
+// Holds an array's read lock for as long as it exists:
+//
+//     NumpyCommonBlockReadGuard<double> guard(*localx);
+//     for (uint64_t i = 0;  i < guard.size();  ++i) total += guard[i];
+template <typename T> class NumpyCommonBlockReadGuard {
+public:
+  NumpyCommonBlockReadGuard(NumpyCommonBlockAccessor<T> &accessor): lock(accessor.lock), view(NULL, 0) {
+    while (pthread_rwlock_rdlock(lock) != 0) usleep(1);
+    accessor.refresh();
+    view = NumpyCommonBlockSpan<const T>(accessor.data, *accessor.count);
+  }
+
+  ~NumpyCommonBlockReadGuard() {
+    pthread_rwlock_unlock(lock);
+  }
+
+  inline const T& operator[](uint64_t index) const { return view[index]; }
+  inline NumpyCommonBlockSpan<const T> span() const { return view; }
+  inline uint64_t size() const { return view.size(); }
+
+private:
+  NumpyCommonBlockReadGuard(const NumpyCommonBlockReadGuard&);              // holds a lock: no copies
+  NumpyCommonBlockReadGuard& operator=(const NumpyCommonBlockReadGuard&);
+
+  pthread_rwlock_t *lock;
+  NumpyCommonBlockSpan<const T> view;
 };
+
+// Holds an array's write lock for as long as it exists.
+template <typename T> class NumpyCommonBlockWriteGuard {
+public:
+  NumpyCommonBlockWriteGuard(NumpyCommonBlockAccessor<T> &accessor): accessor(accessor), lock(accessor.lock), view(NULL, 0) {
+    while (pthread_rwlock_wrlock(lock) != 0) usleep(1);
+    accessor.refresh();
+    accessor.beginwrite();
+    view = NumpyCommonBlockSpan<T>(accessor.data, *accessor.count);
+  }
+
+  ~NumpyCommonBlockWriteGuard() {
+    accessor.endwrite();
+    pthread_rwlock_unlock(lock);
+  }
+
+  inline T& operator[](uint64_t index) const { return view[index]; }
+  inline NumpyCommonBlockSpan<T> span() const { return view; }
+  inline uint64_t size() const { return view.size(); }
+
+private:
+  NumpyCommonBlockWriteGuard(const NumpyCommonBlockWriteGuard&);            // holds a lock: no copies
+  NumpyCommonBlockWriteGuard& operator=(const NumpyCommonBlockWriteGuard&);
+
+  NumpyCommonBlockAccessor<T> &accessor;
+  pthread_rwlock_t *lock;
+  NumpyCommonBlockSpan<T> view;
+};
+
+// Resolves a set of accessors in one pass and reports every missing array and type mismatch together,
+// rather than stopping at the first failed assertion:
+//
+//     NumpyCommonBlockBinder binder(tracksBlock);
+//     binder.bind("trackermu_qoverp", trackermu_qoverp).bind("detid", detid);
+//     if (!binder.ok()) throw std::runtime_error(binder.errors());
+//
+// Successfully bound accessors are allocated with new (like newAccessor); the others are set to NULL.
+class NumpyCommonBlockBinder {
+public:
+  NumpyCommonBlockBinder(NumpyCommonBlock *block, uint64_t slot = 0): block(block), slot(slot), failures(0) { }
+
+  template <typename T> NumpyCommonBlockBinder& bind(const std::string &name, NumpyCommonBlockAccessor<T> *&accessor) {
+    accessor = NULL;
+    int64_t which = block->lookup(name);
+    if (which < 0) {
+      failures++;
+      messages << "no array named \"" << name << "\"\n";
+    }
+    else if (!NumpyCommonBlockDtype<T>::matches(block->dtypes[which], block->itemsizes[which])) {
+      failures++;
+      messages << "array \"" << name << "\" has dtype " << block->types[which] << ", which doesn't match the " << sizeof(T) << "-byte C++ type\n";
+    }
+    else
+      accessor = new NumpyCommonBlockAccessor<T>(block, which, slot);
+    return *this;
+  }
+
+  inline bool ok() const {
+    return failures == 0;
+  }
+
+  // one line per failure
+  inline std::string errors() const {
+    return messages.str();
+  }
+
+private:
+  NumpyCommonBlock *block;
+  uint64_t slot;
+  int failures;
+  std::ostringstream messages;
+};
+
+#endif // NUMPYCOMMONBLOCK
@@ -0,0 +1,213 @@
+// Copyright 2017 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NUMPYCOMMONBLOCKARROW
+#define NUMPYCOMMONBLOCKARROW
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "NumpyCommonBlock.h"
+#include "c2numpy.h"   // for the Arrow C Data Interface structs and their schema helpers
+
+// Hands selected arrays of a block to Arrow code in the same process (Arrow C++, pyarrow, DuckDB, ...)
+// through the Arrow C Data Interface, without copying them:
+//
+//     NumpyCommonBlockArrow arrow(tracksBlock);
+//     arrow.addcolumn("trackermu_qoverp");
+//     arrow.addcolumn("trackermu_phi");
+//     ...
+//     struct ArrowSchema schema;
+//     struct ArrowArray array;
+//     if (arrow.exportto(&schema, &array) == 0) {
+//       ...                        // e.g. arrow::ImportRecordBatch(&array, &schema)
+//     }
+//
+// The export is a struct array with one child per array, each pointing at the array's live items.
+// Until the consumer calls array.release, the export holds the arrays' read locks, so nothing can
+// write to them or grow them; release it promptly, and on the thread that exported it, since POSIX
+// read locks belong to the thread that took them. A release on any other thread is refused (see
+// release). Booleans are the exception to zero-copy: Arrow packs them into bits, so they are copied.
+class NumpyCommonBlockArrow {
+public:
+  NumpyCommonBlockArrow(NumpyCommonBlock *block, uint64_t slot = 0): block(block), slot(slot) { }
+
+  // -1 if there is no such array, it isn't C-contiguous, or its dtype has no Arrow type (structured)
+  int addcolumn(const std::string &name) {
+    int64_t which = block->lookup(name);
+    if (which < 0) return -1;
+
+    uint64_t ndim = block->ndims[which];
+    int64_t expected = block->itemsizes[which];
+    for (int64_t d = ndim - 1;  d >= 0;  --d) {
+      if (block->strides[which][d] != expected) return -1;
+      expected *= block->shapes[which][d];
+    }
+
+    std::string itemFormat;
+    if (descr(which) == ""  ||  c2numpy_arrow_format(descr(which).c_str(), itemFormat) == "") return -1;
+    arrays.push_back(which);
+    return 0;
+  }
+
+  // Fill in (caller-allocated) schema and array; -1 if there are no columns or their live lengths differ.
+  int exportto(struct ArrowSchema *schema, struct ArrowArray *array) {
+    if (arrays.empty()) return -1;
+
+    Export *exported = new Export;
+    exported->block = block;
+    exported->owner = pthread_self();
+
+    // in increasing order, so that two exports of overlapping arrays can't deadlock
+    exported->locked = arrays;
+    std::sort(exported->locked.begin(), exported->locked.end());
+    exported->locked.erase(std::unique(exported->locked.begin(), exported->locked.end()), exported->locked.end());
+    for (uint64_t i = 0;  i < exported->locked.size();  ++i)
+      while (pthread_rwlock_rdlock(block->locks[exported->locked[i]]) != 0) usleep(1);
+
+    int64_t numRows = rows(arrays[0]);
+    for (uint64_t i = 1;  i < arrays.size();  ++i)
+      if (rows(arrays[i]) != numRows) {
+        unlock(exported);
+        return -1;
+      }
+
+    c2numpy_arrow_schema_data *schemaData = new c2numpy_arrow_schema_data;
+    c2numpy_arrow_array_data &arrayData = exported->nodes;
+    c2numpy_arrow_schema_node(schemaData, schema, "+s", "", arrays.size());
+    c2numpy_arrow_array_node(&arrayData, array, numRows, NULL, arrays.size());
+
+    for (uint64_t i = 0;  i < arrays.size();  ++i) {
+      uint64_t which = arrays[i];
+      std::string itemFormat;
+      std::string format = c2numpy_arrow_format(descr(which).c_str(), itemFormat);
+      const char *data = (const char*)block->data[which] + slot * block->lengths[which] * block->itemsizes[which];
+
+      // each dimension after the first is a fixed-size list, and so is a complex number
+      struct ArrowSchema **childSchema = &schema->children[i];
+      struct ArrowArray **childArray = &array->children[i];
+      std::string name = block->names[which];
+      int64_t length = numRows;
+      for (uint64_t d = 1;  d < block->ndims[which];  ++d) {
+        std::stringstream listFormat;
+        listFormat << "+w:" << block->shapes[which][d];
+        schemaData->nodes.push_back(ArrowSchema());
+        arrayData.nodes.push_back(ArrowArray());
+        *childSchema = c2numpy_arrow_schema_node(schemaData, &schemaData->nodes.back(), listFormat.str(), name, 1);
+        *childArray = c2numpy_arrow_array_node(&arrayData, &arrayData.nodes.back(), length, NULL, 1);
+        childSchema = &(*childSchema)->children[0];
+        childArray = &(*childArray)->children[0];
+        name = "item";
+        length *= block->shapes[which][d];
+      }
+      if (itemFormat != "") {
+        schemaData->nodes.push_back(ArrowSchema());
+        arrayData.nodes.push_back(ArrowArray());
+        *childSchema = c2numpy_arrow_schema_node(schemaData, &schemaData->nodes.back(), format, name, 1);
+        *childArray = c2numpy_arrow_array_node(&arrayData, &arrayData.nodes.back(), length, NULL, 1);
+        childSchema = &(*childSchema)->children[0];
+        childArray = &(*childArray)->children[0];
+        format = itemFormat;
+        name = "item";
+        length *= 2;
+      }
+
+      if (format == "b") {
+        arrayData.columns.push_back(std::vector<char>((length + 7) / 8 + 1, 0));
+        std::vector<char> &bits = arrayData.columns.back();
+        for (int64_t j = 0;  j < length;  ++j)
+          if (data[j])
+            bits[j / 8] |= (char)(1 << (j % 8));
+        data = &bits[0];
+      }
+
+      schemaData->nodes.push_back(ArrowSchema());
+      arrayData.nodes.push_back(ArrowArray());
+      *childSchema = c2numpy_arrow_schema_node(schemaData, &schemaData->nodes.back(), format, name, 0);
+      *childArray = c2numpy_arrow_array_node(&arrayData, &arrayData.nodes.back(), length, data, 0);
+    }
+
+    schema->release = c2numpy_arrow_release_schema;
+    schema->private_data = schemaData;
+    array->release = release;
+    array->private_data = exported;
+    return 0;
+  }
+
+private:
+  struct Export {
+    NumpyCommonBlock *block;
+    pthread_t owner;              // the thread that holds the read locks
+    std::vector<uint64_t> locked;
+    c2numpy_arrow_array_data nodes;
+  };
+
+  static void unlock(Export *exported) {
+    for (uint64_t i = 0;  i < exported->locked.size();  ++i)
+      pthread_rwlock_unlock(exported->block->locks[exported->locked[i]]);
+    delete exported;
+  }
+
+  // Unlocking another thread's read lock is undefined (with glibc, it can leave a writer blocked for
+  // good), so a release on the wrong thread fails an assertion or, without assertions, leaves the
+  // export unreleased (and says so), for the exporting thread to release.
+  static void release(struct ArrowArray *array) {
+    Export *exported = (Export*)array->private_data;
+    if (!pthread_equal(exported->owner, pthread_self())) {
+      fprintf(stderr, "NumpyCommonBlockArrow: export released on a thread that didn't make it; its read locks are still held\n");
+      assert(!"NumpyCommonBlockArrow exports must be released on the thread that made them");
+      return;
+    }
+    unlock(exported);
+    array->release = NULL;
+  }
+
+  // live length along the first dimension (the block counts items)
+  int64_t rows(uint64_t which) {
+    uint64_t rowsize = 1;
+    for (uint64_t d = 1;  d < block->ndims[which];  ++d)
+      rowsize *= block->shapes[which][d];
+    return block->counts[which * block->numSlots + slot] / rowsize;
+  }
+
+  // the c2numpy descr of an array's items, for c2numpy_arrow_format
+  std::string descr(uint64_t which) {
+    std::stringstream out;
+    switch (block->dtypes[which]) {
+      case NUMPYCOMMONBLOCK_BOOL:       return "|b1";
+      case NUMPYCOMMONBLOCK_INT8:
+      case NUMPYCOMMONBLOCK_INT16:
+      case NUMPYCOMMONBLOCK_INT32:
+      case NUMPYCOMMONBLOCK_INT64:      out << "<i" << block->itemsizes[which];  break;
+      case NUMPYCOMMONBLOCK_UINT8:
+      case NUMPYCOMMONBLOCK_UINT16:
+      case NUMPYCOMMONBLOCK_UINT32:
+      case NUMPYCOMMONBLOCK_UINT64:     out << "<u" << block->itemsizes[which];  break;
+      case NUMPYCOMMONBLOCK_FLOAT32:
+      case NUMPYCOMMONBLOCK_FLOAT64:    out << "<f" << block->itemsizes[which];  break;
+      case NUMPYCOMMONBLOCK_COMPLEX64:
+      case NUMPYCOMMONBLOCK_COMPLEX128: out << "<c" << block->itemsizes[which];  break;
+      case NUMPYCOMMONBLOCK_STRING:     out << "|S" << block->itemsizes[which];  break;
+      default:                          return "";
+    }
+    return out.str();
+  }
+
+  NumpyCommonBlock *block;
+  uint64_t slot;
+  std::vector<uint64_t> arrays;   // block positions of the columns
+};
+
+#endif // NUMPYCOMMONBLOCKARROW
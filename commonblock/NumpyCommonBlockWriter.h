@@ -0,0 +1,193 @@
+// Copyright 2017 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NUMPYCOMMONBLOCKWRITER
+#define NUMPYCOMMONBLOCKWRITER
+
+#include <string>
+#include <vector>
+
+#include "NumpyCommonBlock.h"
+#include "c2numpy.h"
+
+// Appends the live contents of selected 1-D arrays of a block to a rotated .npy dataset, one column
+// per array, in one c2numpy_columns call per snapshot:
+//
+//     NumpyCommonBlockWriter snapshots(tracksBlock);
+//     snapshots.init("/tmp/tracks", 100000);
+//     snapshots.addcolumn("trackermu_qoverp");
+//     snapshots.addcolumn("trackermu_phi");
+//     ...
+//     snapshots.snapshot();      // after each event
+//     ...
+//     snapshots.close();
+//
+// Each snapshot is consistent across its arrays. Normally it holds all of their read locks while it
+// copies them into the output buffer; in seqlock mode, it copies them without locks and retries if a
+// write overlapped.
+class NumpyCommonBlockWriter {
+public:
+  NumpyCommonBlockWriter(NumpyCommonBlock *block, uint64_t slot = 0): block(block), slot(slot) { }
+
+  int init(const std::string &outputFilePrefix, int32_t numRowsPerFile) {
+    return c2numpy_init(&writer_, outputFilePrefix, numRowsPerFile);
+  }
+
+  // for c2numpy_use_* and other options, before the first snapshot
+  inline c2numpy_writer* writer() {
+    return &writer_;
+  }
+
+  // -1 if there is no such array, it isn't 1-D, or its dtype has no c2numpy type (structured)
+  int addcolumn(const std::string &name) {
+    int64_t which = block->lookup(name);
+    if (which < 0  ||  block->ndims[which] != 1) return -1;
+
+    c2numpy_type type;
+    switch (block->dtypes[which]) {
+      case NUMPYCOMMONBLOCK_BOOL:       type = C2NUMPY_BOOL;       break;
+      case NUMPYCOMMONBLOCK_INT8:       type = C2NUMPY_INT8;       break;
+      case NUMPYCOMMONBLOCK_UINT8:      type = C2NUMPY_UINT8;      break;
+      case NUMPYCOMMONBLOCK_INT16:      type = C2NUMPY_INT16;      break;
+      case NUMPYCOMMONBLOCK_UINT16:     type = C2NUMPY_UINT16;     break;
+      case NUMPYCOMMONBLOCK_INT32:      type = C2NUMPY_INT32;      break;
+      case NUMPYCOMMONBLOCK_UINT32:     type = C2NUMPY_UINT32;     break;
+      case NUMPYCOMMONBLOCK_INT64:      type = C2NUMPY_INT64;      break;
+      case NUMPYCOMMONBLOCK_UINT64:     type = C2NUMPY_UINT64;     break;
+      case NUMPYCOMMONBLOCK_FLOAT32:    type = C2NUMPY_FLOAT32;    break;
+      case NUMPYCOMMONBLOCK_FLOAT64:    type = C2NUMPY_FLOAT64;    break;
+      case NUMPYCOMMONBLOCK_COMPLEX64:  type = C2NUMPY_COMPLEX64;  break;
+      case NUMPYCOMMONBLOCK_COMPLEX128: type = C2NUMPY_COMPLEX128; break;
+      case NUMPYCOMMONBLOCK_STRING:
+        if (block->itemsizes[which] >= 155) return -1;
+        type = (c2numpy_type)(C2NUMPY_STRING + block->itemsizes[which]);
+        break;
+      default:
+        return -1;
+    }
+
+    if (c2numpy_addcolumn(&writer_, name, type) != 0) return -1;
+    arrays.push_back(which);
+    scratch.resize(arrays.size());
+    return 0;
+  }
+
+  // Append one snapshot; returns the number of rows (the arrays' common live length), or -1 if the
+  // arrays have different live lengths or writing failed. In seqlock mode, it also gives up with -1
+  // after maxRetries retries, if maxRetries >= 0 (as optimistic_copy_out does).
+  int64_t snapshot(int64_t maxRetries = -1) {
+    if (arrays.empty()) return -1;
+    if (block->seqs != NULL)
+      return optimisticsnapshot(maxRetries);
+
+    // in increasing order, so that two snapshots of overlapping arrays can't deadlock
+    std::vector<uint64_t> locked(arrays);
+    std::sort(locked.begin(), locked.end());
+    locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+    for (uint64_t i = 0;  i < locked.size();  ++i)
+      while (pthread_rwlock_rdlock(block->locks[locked[i]]) != 0) usleep(1);
+
+    int64_t out = -1;
+    int64_t numRows;
+    if (gather(numRows, false)) {
+      std::vector<const void*> columns(arrays.size());
+      for (uint64_t i = 0;  i < arrays.size();  ++i)
+        columns[i] = pointers[i];
+      if (c2numpy_columns(&writer_, numRows, &columns[0]) == 0)
+        out = numRows;
+    }
+
+    for (uint64_t i = 0;  i < locked.size();  ++i)
+      pthread_rwlock_unlock(block->locks[locked[i]]);
+    return out;
+  }
+
+  int close() {
+    return c2numpy_close(&writer_);
+  }
+
+private:
+  // the copy can't be written straight from the arrays, since a writer may change them while it's written
+  int64_t optimisticsnapshot(int64_t maxRetries) {
+    std::vector<uint64_t> before(arrays.size());
+    int64_t numRows;
+    for (int64_t attempt = 0;  ;  ++attempt) {
+      if (maxRetries >= 0  &&  attempt > maxRetries) return -1;
+      if (attempt >= 16) usleep(1);   // back off once spinning hasn't helped
+
+      bool writing = false;
+      for (uint64_t i = 0;  i < arrays.size();  ++i) {
+        before[i] = __atomic_load_n(&block->seqs[arrays[i]], __ATOMIC_ACQUIRE);
+        writing = writing  ||  (before[i] & 1);
+      }
+      if (writing) continue;
+
+      bool consistent = gather(numRows, true);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      bool changed = false;
+      for (uint64_t i = 0;  i < arrays.size();  ++i)
+        changed = changed  ||  __atomic_load_n(&block->seqs[arrays[i]], __ATOMIC_RELAXED) != before[i];
+      if (changed) continue;
+
+      if (!consistent) return -1;
+      break;
+    }
+
+    std::vector<const void*> columns(arrays.size());
+    for (uint64_t i = 0;  i < arrays.size();  ++i)
+      columns[i] = pointers[i];
+    if (c2numpy_columns(&writer_, numRows, &columns[0]) != 0) return -1;
+    return numRows;
+  }
+
+  // Point each column at contiguous items: the array itself, or a copy in scratch if it's strided or
+  // copy is true. Returns false if the live lengths differ.
+  bool gather(int64_t &numRows, bool copy) {
+    pointers.resize(arrays.size());
+    for (uint64_t i = 0;  i < arrays.size();  ++i) {
+      uint64_t which = arrays[i];
+      uint64_t itemsize = block->itemsizes[which];
+      int64_t stride = block->strides[which][0];
+      uint64_t count = block->counts[which * block->numSlots + slot];
+      const char *data = (const char*)block->data[which] + slot * block->lengths[which] * itemsize;
+
+      if (i == 0)
+        numRows = count;
+      else if ((int64_t)count != numRows)
+        return false;
+
+      if (!copy  &&  stride == (int64_t)itemsize)
+        pointers[i] = data;
+      else {
+        scratch[i].resize(count * itemsize);
+        if (stride == (int64_t)itemsize)
+          memcpy(scratch[i].data(), data, count * itemsize);
+        else
+          for (uint64_t j = 0;  j < count;  ++j)
+            memcpy(&scratch[i][j * itemsize], data + j * stride, itemsize);
+        pointers[i] = scratch[i].data();
+      }
+    }
+    return true;
+  }
+
+  NumpyCommonBlock *block;
+  uint64_t slot;
+  c2numpy_writer writer_;
+  std::vector<uint64_t> arrays;             // block positions of the columns
+  std::vector<const char*> pointers;        // where each column's items are for this snapshot
+  std::vector<std::vector<char> > scratch;  // copies of strided (or, in seqlock mode, all) columns
+};
+
+#endif // NUMPYCOMMONBLOCKWRITER
@@ -12,11 +12,150 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import ast
 import ctypes
+import ctypes.util
+import mmap
+import os
+import platform
+import threading
 import time
 
 import numpy
-import prwlock
+try:
+    import prwlock
+except ImportError:
+    prwlock = None
+
+# futex(2) lets waiters sleep until NumpyCommonBlock.notify (from either side) instead of polling
+_SYS_futex = {"x86_64": 202, "i386": 240, "i686": 240, "aarch64": 98, "armv7l": 240, "ppc64le": 221}.get(platform.machine())
+_FUTEX_WAIT = 0
+_FUTEX_WAKE = 1
+
+if platform.system() == "Linux" and _SYS_futex is not None:
+    _libc = ctypes.CDLL(None, use_errno=True)
+    _libc.syscall.restype = ctypes.c_long
+else:
+    _libc = None
+
+class _timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+def _futex_wait(address, seen, remaining):
+    """Sleep (releasing the GIL) unless the uint32 at address is no longer seen, for at most remaining seconds."""
+    if _libc is None:
+        time.sleep(0.001)
+    elif remaining is None:
+        _libc.syscall(_SYS_futex, ctypes.c_void_p(address), _FUTEX_WAIT, ctypes.c_uint32(seen), None, None, 0)
+    else:
+        ts = _timespec(int(remaining), int((remaining - int(remaining)) * 1e9))
+        _libc.syscall(_SYS_futex, ctypes.c_void_p(address), _FUTEX_WAIT, ctypes.c_uint32(seen), ctypes.byref(ts), None, 0)
+
+def _futex_wake(address):
+    if _libc is not None:
+        _libc.syscall(_SYS_futex, ctypes.c_void_p(address), _FUTEX_WAKE, 0x7fffffff, None, None, 0)
+
+# layout of a shared-memory segment: must match NumpyCommonBlockShared and NumpyCommonBlockSharedArray in C++
+_MAGIC = b"NPCBSHM1"
+_ALIGN = 64
+_LOCKSIZE = 64    # bytes reserved for each pthread_rwlock_t (56 on 64-bit Linux)
+_PTHREAD_PROCESS_SHARED = 1
+
+class _SharedHeader(ctypes.Structure):
+    _fields_ = [
+        ("magic", ctypes.c_char * 8),
+        ("segmentSize", ctypes.c_uint64),
+        ("numArrays", ctypes.c_uint64),
+        ("numSlots", ctypes.c_uint64),
+        ("state", ctypes.c_uint64),
+        ("futex", ctypes.c_uint32),
+        ("seqlock", ctypes.c_uint32),
+        ("writeCursor", ctypes.c_uint64),
+        ("readCursor", ctypes.c_uint64),
+        ("statelockOffset", ctypes.c_uint64),
+        ("slotStatesOffset", ctypes.c_uint64),
+        ("seqsOffset", ctypes.c_uint64),
+        ("arraysOffset", ctypes.c_uint64),
+        ("countsOffset", ctypes.c_uint64)]
+
+_MAXDIMS = 8
+
+class _SharedArray(ctypes.Structure):
+    _fields_ = [
+        ("name", ctypes.c_char * 64),
+        ("type", ctypes.c_char * 256),
+        ("length", ctypes.c_uint64),
+        ("dataOffset", ctypes.c_uint64),
+        ("lockOffset", ctypes.c_uint64),
+        ("itemsize", ctypes.c_uint64),
+        ("ndim", ctypes.c_uint64),
+        ("shape", ctypes.c_uint64 * _MAXDIMS),
+        ("strides", ctypes.c_int64 * _MAXDIMS),
+        ("dtype", ctypes.c_uint32),
+        ("padding", ctypes.c_uint32)]
+
+def _dtype(text):
+    # the type strings in a block are str(dtype), which is a Python literal for structured dtypes
+    if text.startswith("[") or text.startswith("{"):
+        return numpy.dtype(ast.literal_eval(text))
+    return numpy.dtype(text)
+
+# NUMPYCOMMONBLOCK_* codes in C++, so that accessors check types by number
+_DTYPECODES = dict((numpy.dtype(x), i + 1) for i, x in enumerate(
+    ["bool", "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64", "float32", "float64", "complex64", "complex128"]))
+_DTYPE_STRING = 14
+_DTYPE_RECORD = 15
+
+def _dtypecode(dtype):
+    if dtype.fields is not None:
+        return _DTYPE_RECORD
+    if dtype.kind == "S":
+        return _DTYPE_STRING
+    return _DTYPECODES.get(dtype, 0)
+
+# names and dtypes are char* in C++: bytes in Python 3, str in Python 2
+def _tobytes(text):
+    return text if isinstance(text, bytes) else text.encode("ascii")
+
+def _tostr(text):
+    return text if isinstance(text, str) else text.decode("ascii")
+
+def _aligned(offset):
+    return (offset + _ALIGN - 1) & ~(_ALIGN - 1)
+
+_pthread = ctypes.CDLL(ctypes.util.find_library("pthread"), use_errno=True)
+
+class _SharedRWLock(object):
+    """Same interface as prwlock.RWLock, but on a process-shared pthread_rwlock_t at a given address."""
+    def __init__(self, address, initialize=False):
+        self._lock = ctypes.c_void_p(address)
+        if initialize:
+            attr = ctypes.create_string_buffer(64)   # pthread_rwlockattr_t
+            _pthread.pthread_rwlockattr_init(attr)
+            _pthread.pthread_rwlockattr_setpshared(attr, _PTHREAD_PROCESS_SHARED)
+            _pthread.pthread_rwlock_init(self._lock, attr)
+            _pthread.pthread_rwlockattr_destroy(attr)
+
+    def acquire_read(self):
+        _pthread.pthread_rwlock_rdlock(self._lock)
+
+    def acquire_write(self):
+        _pthread.pthread_rwlock_wrlock(self._lock)
+
+    def release(self):
+        _pthread.pthread_rwlock_unlock(self._lock)
+
+def _newlock():
+    """A process-private lock: prwlock.RWLock if it's installed, otherwise a pthread_rwlock_t owned by the lock."""
+    if prwlock is not None:
+        return prwlock.RWLock()
+    memory = ctypes.create_string_buffer(_LOCKSIZE)
+    out = _SharedRWLock(ctypes.addressof(memory), initialize=True)
+    out._memory = memory
+    return out
+
+# int grow(NumpyCommonBlock *block, uint64_t which, uint64_t capacity)
+_growfunction = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64)
 
 class NumpyCommonBlock(object):
     class struct(ctypes.Structure):
@@ -28,13 +167,30 @@ class NumpyCommonBlock(object):
             ("lengths", ctypes.POINTER(ctypes.c_uint64)),
             ("locks", ctypes.POINTER(ctypes.POINTER(None))),
             ("statelock", ctypes.POINTER(None)),
-            ("state", ctypes.c_uint64)]
+            ("state", ctypes.c_uint64),
+            ("futex", ctypes.c_uint32),
+            ("seqs", ctypes.POINTER(ctypes.c_uint64)),
+            ("numSlots", ctypes.c_uint64),
+            ("slotStates", ctypes.POINTER(ctypes.c_uint32)),
+            ("writeCursor", ctypes.c_uint64),
+            ("readCursor", ctypes.c_uint64),
+            ("shared", ctypes.POINTER(None)),
+            ("counts", ctypes.POINTER(ctypes.c_uint64)),
+            ("generation", ctypes.c_uint64),
+            ("grow", _growfunction),
+            ("itemsizes", ctypes.POINTER(ctypes.c_uint64)),
+            ("ndims", ctypes.POINTER(ctypes.c_uint64)),
+            ("shapes", ctypes.POINTER(ctypes.POINTER(ctypes.c_uint64))),
+            ("strides", ctypes.POINTER(ctypes.POINTER(ctypes.c_int64))),
+            ("dtypes", ctypes.POINTER(ctypes.c_uint32)),
+            ("index", ctypes.c_void_p)]
 
-    def __init__(self, *order, **arrays):
-        self._arrays = arrays
+    SLOT_FREE, SLOT_WRITING, SLOT_READY, SLOT_READING = range(4)
 
-        numArrays = len(arrays)
+    _numSlots = 1
+    _shmname = None
 
+    def __init__(self, *order, **arrays):
         self._order = []
         remaining = set(arrays)
         for name in order:
@@ -42,38 +198,494 @@ class NumpyCommonBlock(object):
                 self._order.append(name)
                 remaining.discard(name)
         self._order.extend(sorted(remaining))
-            
-        c_names = ctypes.ARRAY(ctypes.c_char_p, numArrays)(*[ctypes.c_char_p(x) for x in self._order])
-        c_types = ctypes.ARRAY(ctypes.c_char_p, numArrays)(*[ctypes.c_char_p(bytes(arrays[x].dtype)) for x in self._order])
+
+        if self._shmname is None:
+            self._arrays = arrays
+            self._locks = [_newlock() for x in self._order]
+            self._statelock = _newlock()
+            self._slotStates = numpy.zeros(self._numSlots, dtype=numpy.uint32)
+            self._counts = numpy.empty((len(self._order), self._numSlots), dtype=numpy.uint64)
+            self._counts[:] = [[arrays[x].size // self._numSlots] for x in self._order]
+            self._header = None
+        else:
+            self._createshared(arrays)
+
+        self._makestruct()
+
+    def _makestruct(self):
+        numArrays = len(self._order)
+        arrays = self._arrays
+        c_names = ctypes.ARRAY(ctypes.c_char_p, numArrays)(*[ctypes.c_char_p(_tobytes(x)) for x in self._order])
+        c_types = ctypes.ARRAY(ctypes.c_char_p, numArrays)(*[ctypes.c_char_p(_tobytes(str(arrays[x].dtype))) for x in self._order])
         c_data = ctypes.ARRAY(ctypes.POINTER(None), numArrays)(*[
             arrays[x].ctypes.data_as(ctypes.POINTER(None)) for x in self._order])
-        c_lengths = ctypes.ARRAY(ctypes.c_uint64, numArrays)(*[ctypes.c_uint64(numpy.product(arrays[x].shape)) for x in self._order])
-        self._locks = [prwlock.RWLock() for x in self._order]
+        # in a pipelined block, each array has an extra first dimension for the slots
+        c_lengths = ctypes.ARRAY(ctypes.c_uint64, numArrays)(*[ctypes.c_uint64(numpy.prod(arrays[x].shape) // self._numSlots) for x in self._order])
         c_locks = ctypes.ARRAY(ctypes.POINTER(None), numArrays)(*[ctypes.cast(x._lock, ctypes.POINTER(None)) for x in self._locks])
-        self._statelock = prwlock.RWLock()
         c_statelock = ctypes.cast(self._statelock._lock, ctypes.POINTER(None))
 
-        self._struct = self.struct(ctypes.c_uint64(numArrays), c_names, c_types, c_data, c_lengths, c_locks, c_statelock, ctypes.c_uint64(0))
+        self._struct = self.struct(ctypes.c_uint64(numArrays), c_names, c_types, c_data, c_lengths, c_locks, c_statelock, ctypes.c_uint64(0), ctypes.c_uint32(0), None)
+        self._seqs = None
+
+        self._struct.numSlots = self._numSlots
+        self._struct.slotStates = self._slotStates.ctypes.data_as(ctypes.POINTER(ctypes.c_uint32))
+        self._struct.counts = self._counts.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64))
+
+        # arrays keep their shape and layout: C++ indexes them by strides
+        self._itemsizes = numpy.array([arrays[x].dtype.itemsize for x in self._order], dtype=numpy.uint64)
+        self._ndims = numpy.array([self._slotview(x).ndim for x in self._order], dtype=numpy.uint64)
+        self._shapes = [numpy.array(self._slotview(x).shape, dtype=numpy.uint64) for x in self._order]
+        self._strides = [numpy.array(self._slotview(x).strides, dtype=numpy.int64) for x in self._order]
+        self._struct.itemsizes = self._itemsizes.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64))
+        self._dtypes = numpy.array([_dtypecode(arrays[x].dtype) for x in self._order], dtype=numpy.uint32)
+        self._struct.dtypes = self._dtypes.ctypes.data_as(ctypes.POINTER(ctypes.c_uint32))
+        self._struct.ndims = self._ndims.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64))
+        self._struct.shapes = ctypes.ARRAY(ctypes.POINTER(ctypes.c_uint64), numArrays)(*[x.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64)) for x in self._shapes])
+        self._struct.strides = ctypes.ARRAY(ctypes.POINTER(ctypes.c_int64), numArrays)(*[x.ctypes.data_as(ctypes.POINTER(ctypes.c_int64)) for x in self._strides])
+
+        # a shared-memory segment has a fixed size; otherwise, C++ can ask Python to reallocate
+        if self._header is None:
+            self._growfunction = _growfunction(self._grow)
+            self._struct.grow = self._growfunction
+        self._retired = []
+
+        # state, futex and cursors live in the segment for a shared block (so other processes see them)
+        if self._header is None:
+            self._control = self._struct
+        else:
+            self._control = self._header
+            self._struct.shared = ctypes.cast(ctypes.pointer(self._header), ctypes.POINTER(None))
+        self._futex = ctypes.addressof(self._control) + type(self._control).futex.offset
+
+    @classmethod
+    def _make(cls, shmname, numSlots, order, arrays):
+        out = cls.__new__(cls)
+        out._shmname = shmname
+        out._numSlots = numSlots
+        if numSlots > 1:
+            arrays = dict((name, numpy.zeros((numSlots,) + array.shape, dtype=array.dtype)) for name, array in arrays.items())
+        out.__init__(*order, **arrays)
+        return out
+
+    @classmethod
+    def pipelined(cls, numSlots, *order, **arrays):
+        """A block with numSlots copies of each array (shaped like the given ones), so that the producer can
+        fill one batch while the consumer reads another: see acquire_for_write, publish, acquire_for_read,
+        release and slot."""
+        return cls._make(None, numSlots, order, arrays)
+
+    @classmethod
+    def shared(cls, name, *order, **arrays):
+        """A block in a new POSIX shared-memory segment (/dev/shm/name), initialized with copies of the given
+        arrays, so that separate processes can use it: NumpyCommonBlock.attach(name) in Python or
+        NumpyCommonBlock::attach(name) in C++. Arrays, locks, state and slots behave as in-process.
+        Call unlink() when no new process needs to attach."""
+        return cls._make(name, 1, order, arrays)
+
+    @classmethod
+    def sharedpipelined(cls, name, numSlots, *order, **arrays):
+        """A pipelined block (see pipelined) in shared memory (see shared)."""
+        return cls._make(name, numSlots, order, arrays)
+
+    def _sharedarray(self, dtype, count, offset):
+        return numpy.frombuffer(self._mmap, dtype=dtype, count=count, offset=offset)
+
+    def _createshared(self, arrays):
+        numArrays = len(self._order)
+
+        offset = _aligned(ctypes.sizeof(_SharedHeader))
+        arraysOffset = offset
+        offset = _aligned(offset + numArrays * ctypes.sizeof(_SharedArray))
+        statelockOffset = offset
+        lockOffsets = [statelockOffset + _LOCKSIZE * (i + 1) for i in range(numArrays)]
+        offset = _aligned(offset + _LOCKSIZE * (numArrays + 1))
+        slotStatesOffset = offset
+        offset = _aligned(offset + 4 * self._numSlots)
+        seqsOffset = offset
+        offset = _aligned(offset + 8 * numArrays)
+        countsOffset = offset
+        offset = _aligned(offset + 8 * numArrays * self._numSlots)
+        dataOffsets = []
+        for name in self._order:
+            dataOffsets.append(offset)
+            offset = _aligned(offset + arrays[name].nbytes)
+
+        fd = os.open("/dev/shm/" + self._shmname, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o600)
+        try:
+            os.ftruncate(fd, offset)
+            self._mmap = mmap.mmap(fd, offset)
+        finally:
+            os.close(fd)
+
+        self._header = _SharedHeader.from_buffer(self._mmap)
+        self._header.segmentSize = offset
+        self._header.numArrays = numArrays
+        self._header.numSlots = self._numSlots
+        self._header.statelockOffset = statelockOffset
+        self._header.slotStatesOffset = slotStatesOffset
+        self._header.seqsOffset = seqsOffset
+        self._header.arraysOffset = arraysOffset
+        self._header.countsOffset = countsOffset
+
+        base = ctypes.addressof(self._header)
+        descriptors = (_SharedArray * numArrays).from_buffer(self._mmap, arraysOffset)
+        self._arrays = {}
+        for i, name in enumerate(self._order):
+            array = arrays[name]
+            assert len(name) < 64 and len(str(array.dtype)) < 256 and array.ndim <= _MAXDIMS
+            descriptors[i].name = _tobytes(name)
+            descriptors[i].type = _tobytes(str(array.dtype))
+            descriptors[i].length = array.size // self._numSlots
+            descriptors[i].dataOffset = dataOffsets[i]
+            descriptors[i].lockOffset = lockOffsets[i]
+            self._arrays[name] = self._sharedarray(array.dtype, array.size, dataOffsets[i]).reshape(array.shape)
+            self._arrays[name][...] = array
+            view = self._slotview(name)
+            descriptors[i].itemsize = view.itemsize
+            descriptors[i].dtype = _dtypecode(array.dtype)
+            descriptors[i].ndim = view.ndim
+            descriptors[i].shape[:view.ndim] = view.shape
+            descriptors[i].strides[:view.ndim] = view.strides
+
+        self._locks = [_SharedRWLock(base + x, initialize=True) for x in lockOffsets]
+        self._statelock = _SharedRWLock(base + statelockOffset, initialize=True)
+        self._slotStates = self._sharedarray(numpy.uint32, self._numSlots, slotStatesOffset)
+        self._counts = self._sharedarray(numpy.uint64, numArrays * self._numSlots, countsOffset).reshape(numArrays, self._numSlots)
+        self._counts[:] = [[arrays[x].size // self._numSlots] for x in self._order]
+
+        # last, so that nobody attaches to a half-built segment
+        self._header.magic = _MAGIC
+
+    @classmethod
+    def attach(cls, name):
+        """Attach to a block that another process created with NumpyCommonBlock.shared(name, ...)."""
+        out = cls.__new__(cls)
+        out._shmname = name
+        fd = os.open("/dev/shm/" + name, os.O_RDWR)
+        try:
+            out._mmap = mmap.mmap(fd, os.fstat(fd).st_size)
+        finally:
+            os.close(fd)
+
+        out._header = _SharedHeader.from_buffer(out._mmap)
+        if out._header.magic != _MAGIC or out._header.segmentSize != len(out._mmap):
+            raise IOError("/dev/shm/{0} is not a (finished) NumpyCommonBlock".format(name))
+        out._numSlots = out._header.numSlots
+
+        base = ctypes.addressof(out._header)
+        descriptors = (_SharedArray * out._header.numArrays).from_buffer(out._mmap, out._header.arraysOffset)
+        out._order = [_tostr(x.name) for x in descriptors]
+        out._arrays = {}
+        for x in descriptors:
+            shape = tuple(x.shape[:x.ndim])
+            if out._numSlots > 1:
+                shape = (out._numSlots,) + shape
+            out._arrays[_tostr(x.name)] = out._sharedarray(_dtype(_tostr(x.type)), x.length * out._numSlots, x.dataOffset).reshape(shape)
+        out._locks = [_SharedRWLock(base + x.lockOffset) for x in descriptors]
+        out._statelock = _SharedRWLock(base + out._header.statelockOffset)
+        out._slotStates = out._sharedarray(numpy.uint32, out._numSlots, out._header.slotStatesOffset)
+        out._counts = out._sharedarray(numpy.uint64, len(out._order) * out._numSlots, out._header.countsOffset).reshape(len(out._order), out._numSlots)
+
+        out._makestruct()
+        if out._header.seqlock:
+            out.seqlock()
+        return out
+
+    def unlink(self):
+        """Remove the shared-memory segment's name; processes that have attached keep using it."""
+        os.unlink("/dev/shm/" + self._shmname)
+
+    def slot(self, slot):
+        """The live items of each array in one slot, as a dict of views."""
+        return dict((name, self.live(name, slot)) for name in self._order)
+
+    def _slotview(self, name, slot=0):
+        array = self._arrays[name]
+        if self._numSlots > 1:
+            array = array[slot]
+        return array
+
+    def _rowsize(self, name):
+        return int(numpy.prod(self._slotview(name).shape[1:]))
+
+    def live(self, name, slot=0):
+        """View of the live items of an array (see resize)."""
+        return self._slotview(name, slot)[:self._counts[self._order.index(name), slot] // self._rowsize(name)]
+
+    def capacity(self, name):
+        """Allocated length of an array, along its first dimension."""
+        return len(self._slotview(name))
+
+    def resize(self, name, n, slot=0):
+        """Set the live length of an array (along its first dimension), reallocating it (to the larger of n
+        and twice the capacity) if it doesn't fit; returns False if it can't grow. C++ does the same with
+        accessor.resize(n)."""
+        index = self._order.index(name)
+        lock = self._locks[index]
+        lock.acquire_write()
+        try:
+            capacity = self.capacity(name)
+            rowsize = self._rowsize(name)
+            if n > capacity:
+                if not self._grow(None, index, max(n, 2 * capacity) * rowsize):
+                    return False
+                self._struct.generation += 1
+            if self._seqs is not None:
+                self._seqs[index] += 1
+            self._counts[index, slot] = n * rowsize
+            if self._seqs is not None:
+                self._seqs[index] += 1
+            return True
+        finally:
+            lock.release()
+
+    def _grow(self, block, which, capacity):
+        # called with the array's write lock held, possibly from C++
+        if self._header is not None:
+            return 0
+        # with several slots, all of them move, even READY and READING ones: nobody writes into
+        # those, so a consumer still reading the old array (kept in _retired) sees the same items
+
+        # capacity is in items: round up to whole rows
+        name = self._order[which]
+        old = self._arrays[name]
+        rowsize = self._rowsize(name)
+        rows = -(-capacity // rowsize)
+        shape = (rows,) + self._slotview(name).shape[1:]
+        if self._numSlots == 1:
+            new = numpy.zeros(shape, dtype=old.dtype)
+            live = self._counts[which, 0] // rowsize
+            new[:live] = old[:live]
+        else:
+            new = numpy.zeros((self._numSlots,) + shape, dtype=old.dtype)
+            for slot in range(self._numSlots):
+                live = self._counts[which, slot] // rowsize
+                new[slot, :live] = old[slot, :live]
+
+        # an old array is kept while unlocked readers in C++ may still be copying from it: they move to
+        # the new one at their next access, so one retired by an earlier grow (an older generation) is
+        # freed here, unless a consumer holds a slot and may still be reading it; this bounds _retired
+        # to the arrays of the latest grow while no slot is READING
+        generation = self._struct.generation
+        if not (self._slotStates == self.SLOT_READING).any():
+            self._retired = [(g, x) for g, x in self._retired if g == generation]
+        self._retired.append((generation, old))
+
+        self._arrays[name] = new
+        self._struct.data[which] = new.ctypes.data_as(ctypes.POINTER(None))
+        self._struct.lengths[which] = rows * rowsize
+        self._shapes[which][0] = rows
+        self._strides[which][:] = self._slotview(name).strides
+        return 1
+
+    def _waitslot(self, slot, forstate, timeout):
+        deadline = None if timeout is None else time.time() + timeout
+        address = self._slotStates.ctypes.data + slot * self._slotStates.itemsize
+        while True:
+            seen = int(self._slotStates[slot])
+            if seen == forstate:
+                return True
+            remaining = None
+            if deadline is not None:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    return False
+            _futex_wait(address, seen, remaining)
+
+    def _setslot(self, slot, state):
+        self._slotStates[slot] = state
+        _futex_wake(self._slotStates.ctypes.data + slot * self._slotStates.itemsize)
+
+    def acquire_for_write(self, timeout=None):
+        """Producer: wait for the next slot to be free and return its index (or None on timeout)."""
+        slot = self._control.writeCursor % self._numSlots
+        if not self._waitslot(slot, self.SLOT_FREE, timeout):
+            return None
+        self._slotStates[slot] = self.SLOT_WRITING
+        self._control.writeCursor += 1
+        return slot
+
+    def publish(self, slot):
+        """Producer: hand a filled slot to the consumer."""
+        assert self._slotStates[slot] == self.SLOT_WRITING
+        self._setslot(slot, self.SLOT_READY)
+
+    def acquire_for_read(self, timeout=None):
+        """Consumer: wait for the next slot to be published and return its index (or None on timeout)."""
+        slot = self._control.readCursor % self._numSlots
+        if not self._waitslot(slot, self.SLOT_READY, timeout):
+            return None
+        self._slotStates[slot] = self.SLOT_READING
+        self._control.readCursor += 1
+        return slot
+
+    def release(self, slot):
+        """Consumer: give a slot back to the producer."""
+        assert self._slotStates[slot] == self.SLOT_READING
+        self._setslot(slot, self.SLOT_FREE)
+
+    def seqlock(self):
+        """Turn on seqlock mode: every write also makes a per-array sequence number odd while it lasts, so
+        that readers (snapshot, pandas, accessors here, optimistic_copy_out in C++) copy without taking
+        locks and retry if a write overlapped. Call this before passing pointer() to C++."""
+        if self._seqs is None:
+            if self._header is None:
+                self._seqs = numpy.zeros(len(self._order), dtype=numpy.uint64)
+            else:
+                # in shared memory, processes that attach later pick it up
+                self._seqs = self._sharedarray(numpy.uint64, len(self._order), self._header.seqsOffset)
+                self._header.seqlock = 1
+            self._struct.seqs = self._seqs.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64))
+
+    @staticmethod
+    def _optimistic(seqs, index, read, maxRetries=-1):
+        # like optimistic_copy_out in C++: None if writes overlapped all maxRetries + 1 attempts
+        attempt = 0
+        while maxRetries < 0 or attempt <= maxRetries:
+            if attempt >= 16:
+                time.sleep(1e-6)   # back off once spinning hasn't helped
+            attempt += 1
+            before = seqs[index]
+            if before & 1:
+                continue
+            out = read()
+            if seqs[index] == before:
+                return out
+        return None
 
     def pointer(self):
         return ctypes.addressof(self._struct)
 
-    def pandas(self):
+    def snapshot(self, maxRetries=-1):
+        """Consistent copies of all arrays, as a dict; lock-free in seqlock mode, where it gives up and returns
+        None if writes overlapped more than maxRetries retries of an array (if maxRetries is not negative)."""
+        if self._seqs is not None:
+            out = {}
+            for i, name in enumerate(self._order):
+                out[name] = self._optimistic(self._seqs, i, lambda name=name: self.live(name).copy(), maxRetries)
+                if out[name] is None:
+                    return None
+            return out
+        out = {}
+        for name, lock in zip(self._order, self._locks):
+            lock.acquire_read()
+            try:
+                out[name] = self.live(name).copy()
+            finally:
+                lock.release()
+        return out
+
+    def pandas(self, slot=None, maxRetries=-1):
         import pandas
+        if slot is not None:
+            # a slot between acquire_for_read and release belongs to the reader; no locks needed
+            return pandas.DataFrame(self.slot(slot), columns=self._order)
+        if self._seqs is not None:
+            # doesn't stall the writer
+            arrays = self.snapshot(maxRetries)
+            if arrays is None:
+                return None
+            return pandas.DataFrame(arrays, columns=self._order)
         for lock in self._locks:
             lock.acquire_read()
         try:
-            return pandas.DataFrame(self._arrays, columns=self._order)
+            return pandas.DataFrame(self.slot(0), columns=self._order)
         finally:
             for lock in self._locks:
                 lock.release()
 
+    class ArrowExport(object):
+        """A pyarrow.RecordBatch (batch) that points into a block, and the read locks that keep writers out
+        while it's in use. POSIX read locks belong to the thread that took them, so release must be called
+        on that thread (a with statement does it); it isn't left to garbage collection, which could run
+        anywhere. After release, the batch may change under you: copy what you need to keep."""
+        def __init__(self, locks):
+            self._locks = locks
+            self._thread = threading.current_thread()
+            self.batch = None
+            for lock in self._locks:
+                lock.acquire_read()
+
+        def release(self):
+            if self._locks is None:
+                return
+            if threading.current_thread() is not self._thread:
+                raise RuntimeError("an ArrowExport must be released on the thread that made it ({0})".format(self._thread.name))
+            for lock in self._locks:
+                lock.release()
+            self._locks = None
+
+        def __enter__(self):
+            return self.batch
+
+        def __exit__(self, type, value, traceback):
+            self.release()
+
+    def _arrowarray(self, array):
+        import pyarrow
+        if array.ndim > 1:
+            flat = self._arrowarray(array.reshape((array.shape[0] * array.shape[1],) + array.shape[2:]))
+            return pyarrow.FixedSizeListArray.from_arrays(flat, array.shape[1])
+        if array.dtype.kind == "b":
+            return pyarrow.array(array)     # Arrow packs booleans into bits: a copy
+        if array.dtype.kind == "c":
+            return pyarrow.FixedSizeListArray.from_arrays(self._arrowarray(array.view(array.real.dtype)), 2)
+        if array.dtype.kind == "S":
+            arrowtype = pyarrow.binary(array.dtype.itemsize)
+        else:
+            arrowtype = pyarrow.from_numpy_dtype(array.dtype)
+        # the view keeps its memory alive even if the array is reallocated (see _grow)
+        buffer = pyarrow.foreign_buffer(array.ctypes.data, array.nbytes, base=array)
+        return pyarrow.Array.from_buffers(arrowtype, len(array), [None, buffer])
+
+    def arrow(self, names=None, slot=0):
+        """Live items of the named arrays (default: all) as an ArrowExport, whose batch is a pyarrow.RecordBatch
+        that points into the block, without copying (except booleans, which Arrow packs into bits). Arrays
+        with more than one dimension become fixed-size lists, as do complex numbers (of two floats);
+        structured arrays and strided views are not supported.
+
+        The export holds the arrays' read locks, so writers (here or in C++) wait until it's released, on the
+        same thread:
+
+            with block.arrow(["x", "y"]) as batch:
+                table = pyarrow.Table.from_batches([batch]).to_pandas()   # a copy, usable afterward
+        """
+        if names is None:
+            names = self._order
+        indexes = sorted(set(self._order.index(name) for name in names))
+        out = self.ArrowExport([self._locks[i] for i in indexes])   # in increasing order, like C++
+
+        try:
+            views = [self.live(name, slot) for name in names]
+            for name, view in zip(names, views):
+                if view.dtype.fields is not None or not view.flags.c_contiguous:
+                    raise TypeError("array {0} has no zero-copy Arrow equivalent".format(repr(name)))
+                if len(view) != len(views[0]):
+                    raise ValueError("arrays {0} and {1} have different live lengths".format(repr(names[0]), repr(name)))
+
+            import pyarrow
+            out.batch = pyarrow.RecordBatch.from_arrays([self._arrowarray(view) for view in views], names)
+        except:
+            out.release()
+            raise
+        return out
+
     class Accessor(object):
-        def __init__(self, lock, array):
-            self.lock = lock
-            self.array = array
+        def __init__(self, block, name):
+            self.block = block
+            self.name = name
+            self.index = block._order.index(name)
+            self.lock = block._locks[self.index]
+
+        @property
+        def array(self):
+            # looked up every time, since the array may have been resized or reallocated
+            return self.block.live(self.name)
 
         def __getitem__(self, slice):
+            seqs = self.block._seqs
+            if seqs is not None:
+                return NumpyCommonBlock._optimistic(seqs, self.index, lambda: numpy.array(self.array[slice]))
             self.lock.acquire_read()
             try:
                 return self.array[slice]
@@ -81,42 +693,55 @@ class NumpyCommonBlock(object):
                 self.lock.release()
 
         def __setitem__(self, slice, value):
+            seqs = self.block._seqs
             self.lock.acquire_write()
             try:
+                if seqs is not None:
+                    seqs[self.index] += 1
                 self.array[slice] = value
+                if seqs is not None:
+                    seqs[self.index] += 1
             finally:
                 self.lock.release()
 
         def size(self):
             return len(self.array)
 
+        def resize(self, n):
+            return self.block.resize(self.name, n)
+
     def accessor(self, name):
-        return self.Accessor(self._locks[self._order.index(name)], self._arrays[name])
+        return self.Accessor(self, name)
 
-    def _wait(self, condition):
-        self._statelock.acquire_read()
-        try:
-            current = self._struct.state
-        finally:
-            self._statelock.release()
+    def _wait(self, condition, timeout):
+        deadline = None if timeout is None else time.time() + timeout
+        while True:
+            seen = self._control.futex
+            if not condition(self._control.state):
+                return True
 
-        while condition(current):
-            time.sleep(0.001)
-            self._statelock.acquire_read()
-            try:
-                current = self._struct.state
-            finally:
-                self._statelock.release()
+            remaining = None
+            if deadline is not None:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    return False
+
+            # sleeps only if nobody has notified since "seen" was read
+            _futex_wait(self._futex, seen, remaining)
 
-    def wait(self, forstate):
-        self._wait(lambda current: current != forstate)
+    def wait(self, forstate, timeout=None):
+        """Block until state == forstate; returns False if timeout (seconds) passes first."""
+        return self._wait(lambda current: current != forstate, timeout)
 
-    def waitmask(self, formask):
-        self._wait(lambda current: not (current & formask))
+    def waitmask(self, formask, timeout=None):
+        """Block until state & formask is nonzero; returns False if timeout (seconds) passes first."""
+        return self._wait(lambda current: not (current & formask), timeout)
 
     def notify(self, newstate):
         self._statelock.acquire_write()
         try:
-            self._struct.state = newstate
+            self._control.state = newstate
+            self._control.futex = (self._control.futex + 1) & 0xffffffff
         finally:
             self._statelock.release()
+        _futex_wake(self._futex)
@@ -0,0 +1,268 @@
+// Copyright 2017 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The C++ half of "make commonblocktest": built as libcommonblocktest.so and called by commonblocktest.py
+// through ctypes, with blocks that Python made (the only way to make them). Each test returns 0 if it
+// passed, or prints what failed and returns 1.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "NumpyCommonBlock.h"
+#include "NumpyCommonBlockArrow.h"
+#include "NumpyCommonBlockWriter.h"
+
+struct Pair {
+  int32_t a;
+  int32_t b;
+};
+NUMPYCOMMONBLOCK_RECORD_TYPE(Pair)
+
+#define CHECK(condition)                                                   \
+  if (!(condition)) {                                                      \
+    printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #condition);           \
+    fflush(stdout);                                                        \
+    return 1;                                                              \
+  }
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void sleepfor(double seconds) {
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+// notify from another thread after a delay, to wake a waiter
+static void notifylater(NumpyCommonBlock *block, uint64_t newstate, double delay) {
+  sleepfor(delay);
+  block->notify(newstate);
+}
+
+extern "C" {
+
+// futex wait/notify, timeouts and masks on any block
+int test_wait(NumpyCommonBlock *block) {
+  block->notify(0);
+
+  double start = now();
+  CHECK(!block->wait(1, 0.05));
+  CHECK(now() - start >= 0.045);
+  CHECK(!block->waitmask(~0ULL, 0.01));     // no bit is set: not the same as wait(0)
+  CHECK(block->wait(0, 0));
+
+  std::thread notifier(notifylater, block, 6, 0.02);
+  start = now();
+  CHECK(block->waitmask(~0ULL, 5));
+  CHECK(now() - start < 4);
+  notifier.join();
+  CHECK(block->wait(6, 0));
+  CHECK(!block->waitmask(1, 0.01));
+  CHECK(block->waitmask(2, 0));
+
+  std::thread another(notifylater, block, 9, 0.02);
+  CHECK(block->wait(9, 5));
+  another.join();
+  return 0;
+}
+
+// block has a float64 array "x" of 8 items, in seqlock mode
+int test_seqlock(NumpyCommonBlock *block) {
+  NumpyCommonBlockAccessor<double> x = block->accessor<double>("x");
+  CHECK(x.size() == 8);
+  double copy[8];
+
+  // a write in progress: the optimistic read gives up after its retries
+  x.beginwrite();
+  CHECK(!x.optimistic_copy_out(0, copy, 8, 3));
+  x.endwrite();
+  CHECK(x.optimistic_copy_out(0, copy, 8, 3));
+  CHECK(!x.optimistic_copy_out(4, copy, 8, 3));   // past the end: false, not an assertion
+
+  // a writer that always sets all 8 items to the same value: no copy may mix two writes
+  x.fill(0, 8, -1);
+  bool done = false;
+  std::thread writer([&x, &done]() {
+    double values[8];
+    for (int k = 0;  !__atomic_load_n(&done, __ATOMIC_ACQUIRE);  ++k) {
+      std::fill(values, values + 8, (double)k);
+      x.safecopy_in(0, values, 8);
+    }
+  });
+  bool consistent = true;
+  for (int i = 0;  i < 10000;  ++i) {
+    x.optimistic_copy_out(0, copy, 8);
+    for (int j = 1;  j < 8;  ++j)
+      consistent = consistent  &&  copy[j] == copy[0];
+  }
+  __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  writer.join();
+  CHECK(consistent);
+  return 0;
+}
+
+// block is pipelined with an int64 array "x" of 4 items per slot
+int test_slots(NumpyCommonBlock *block) {
+  uint64_t numSlots = block->slots();
+  CHECK(numSlots > 1);
+  CHECK(block->acquire_for_read(0.01) == -1);   // nothing published yet
+
+  // the producer can get ahead by numSlots batches, no more
+  for (uint64_t i = 0;  i < numSlots;  ++i) {
+    int64_t slot = block->acquire_for_write(0);
+    CHECK(slot == (int64_t)i);
+    block->accessor<int64_t>("x", slot).set(0, -1);
+    block->publish(slot);
+  }
+  CHECK(block->acquire_for_write(0.01) == -1);
+  for (uint64_t i = 0;  i < numSlots;  ++i) {
+    int64_t slot = block->acquire_for_read(0);
+    CHECK(slot == (int64_t)i);
+    CHECK(block->accessor<int64_t>("x", slot).get(0) == -1);
+    block->release(slot);
+  }
+
+  // then batches through the ring, on two threads
+  const int64_t numBatches = 1000;
+  std::thread producer([block]() {
+    for (int64_t batch = 0;  batch < numBatches;  ++batch) {
+      int64_t slot = block->acquire_for_write(5);
+      if (slot < 0) return;
+      NumpyCommonBlockAccessor<int64_t> x = block->accessor<int64_t>("x", slot);
+      for (uint64_t i = 0;  i < 4;  ++i)
+        x.set(i, batch * 10 + i);
+      block->publish(slot);
+    }
+  });
+  bool inorder = true;
+  int64_t batch = 0;
+  for (;  batch < numBatches;  ++batch) {
+    int64_t slot = block->acquire_for_read(5);
+    if (slot < 0) break;
+    NumpyCommonBlockAccessor<int64_t> x = block->accessor<int64_t>("x", slot);
+    for (uint64_t i = 0;  i < 4;  ++i)
+      inorder = inorder  &&  x.get(i) == batch * 10 + (int64_t)i;
+    block->release(slot);
+  }
+  producer.join();
+  CHECK(batch == numBatches);
+  CHECK(inorder);
+  return 0;
+}
+
+// block is Python-owned (so it can grow) with a float64 array "x" of 4 items
+int test_grow(NumpyCommonBlock *block) {
+  NumpyCommonBlockAccessor<double> x = block->accessor<double>("x");
+  NumpyCommonBlockAccessor<double> other = block->accessor<double>("x");
+  CHECK(other.capacity() == 4);
+
+  CHECK(x.resize(2));
+  CHECK(x.size() == 2  &&  x.capacity() == 4);
+  for (int i = 0;  i < 10;  ++i)
+    CHECK(x.push_back(100 + i));
+  CHECK(x.size() == 12  &&  x.capacity() >= 12);
+
+  // the other accessor still points at the old array until it sees the new generation
+  CHECK(other.size() == 12  &&  other.capacity() == x.capacity());
+  CHECK(other.get(0) == 0  &&  other.get(1) == 1  &&  other.get(11) == 109);
+  return 0;
+}
+
+// block is seqlocked with a float64 array "x" of 8 items; writes prefix0.npy
+int test_snapshot(NumpyCommonBlock *block, const char *prefix) {
+  NumpyCommonBlockWriter snapshots(block);
+  CHECK(snapshots.init(prefix, 100) == 0);
+  CHECK(snapshots.addcolumn("x") == 0);
+
+  NumpyCommonBlockAccessor<double> x = block->accessor<double>("x");
+  x.beginwrite();
+  CHECK(snapshots.snapshot(3) == -1);
+  x.endwrite();
+  CHECK(snapshots.snapshot(3) == 8);
+  CHECK(snapshots.close() == 0);
+  return 0;
+}
+
+// block has a float64 array "x" of 8 items, 1 to 7 after the first
+int test_arrow(NumpyCommonBlock *block) {
+  NumpyCommonBlockArrow arrow(block);
+  CHECK(arrow.addcolumn("x") == 0);
+  struct ArrowSchema schema;
+  struct ArrowArray array;
+  CHECK(arrow.exportto(&schema, &array) == 0);
+  CHECK(array.length == 8  &&  array.n_children == 1  &&  std::string(schema.children[0]->format) == "g");
+  const double *values = (const double*)array.children[0]->buffers[1];
+  CHECK(values[1] == 1  &&  values[7] == 7);
+  array.release(&array);
+  schema.release(&schema);
+  CHECK(array.release == NULL);
+
+  // the read lock is gone, so a writer gets in
+  block->accessor<double>("x").safeset(0, 100);
+  CHECK(block->accessor<double>("x").safeget(0) == 100);
+  return 0;
+}
+
+// block has arrays "x" (float64), "s" (|S8) and "r" (int32 fields a and b), 2 items each
+int test_dtypes(NumpyCommonBlock *block) {
+  NumpyCommonBlockAccessor<double> *x, *s;
+  NumpyCommonBlockAccessor<long long> *other;
+  NumpyCommonBlockAccessor<NumpyCommonBlockString<8> > *s8, *x8;
+  NumpyCommonBlockAccessor<NumpyCommonBlockString<4> > *s4;
+  NumpyCommonBlockAccessor<Pair> *r, *rs;
+  NumpyCommonBlockBinder binder(block);
+  binder.bind("x", x).bind("s", s).bind("s", other).bind("s", s8).bind("x", x8).bind("s", s4).bind("r", r).bind("s", rs);
+
+  // only same-size types of the same kind: not a double, an undeclared type or a struct on |S8
+  CHECK(x != NULL  &&  s == NULL  &&  other == NULL);
+  CHECK(s8 != NULL  &&  x8 == NULL  &&  s4 == NULL);
+  CHECK(r != NULL  &&  rs == NULL);
+  CHECK(s8->get(1).str() == "two"  &&  r->get(1).a == 3  &&  r->get(1).b == 4);
+  delete x;
+  delete s8;
+  delete r;
+
+  // the name index is freed and, if needed again, rebuilt
+  NumpyCommonBlock::forget(block);
+  CHECK(block->lookup("r") >= 0  &&  std::string(block->name(block->lookup("r"))) == "r"  &&  block->lookup("nope") == -1);
+  NumpyCommonBlock::forget(block);
+  return 0;
+}
+
+// run in a child process: block "name" has an int32 array "y" of 5 items, 0 to 4
+int test_attach(const char *name) {
+  CHECK(NumpyCommonBlock::attach("no-such-commonblock") == NULL  &&  errno == ENOENT);
+
+  NumpyCommonBlock *block = NumpyCommonBlock::attach(name);
+  CHECK(block != NULL);
+  NumpyCommonBlockAccessor<int32_t> y = block->accessor<int32_t>("y");
+  CHECK(y.size() == 5);
+  for (int32_t i = 0;  i < 5;  ++i) {
+    CHECK(y.safeget(i) == i);
+    y.safeset(i, 10 * i);
+  }
+  CHECK(!y.resize(100));                     // a segment has a fixed size
+
+  // the parent waits for 2 and answers with 3, across processes
+  block->notify(2);
+  CHECK(block->wait(3, 5));
+  CHECK(y.safeget(0) == 99);
+  NumpyCommonBlock::detach(block);
+  return 0;
+}
+
+}
@@ -0,0 +1,199 @@
+# Copyright 2017 Jim Pivarski
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Tests of commonblock.py, and (through libcommonblocktest.so, from commonblocktest.cc) of the C++
+# headers on the same blocks: run with "make commonblocktest".
+
+import ctypes
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+import numpy
+
+from commonblock import NumpyCommonBlock
+
+cpp = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), "libcommonblocktest.so"))
+for name in "test_wait", "test_seqlock", "test_slots", "test_grow", "test_snapshot", "test_arrow", "test_dtypes", "test_attach":
+    getattr(cpp, name).restype = ctypes.c_int
+    getattr(cpp, name).argtypes = [ctypes.c_char_p] if name == "test_attach" else [ctypes.c_void_p]
+cpp.test_snapshot.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+
+def notifylater(block, newstate, delay):
+    thread = threading.Thread(target=lambda: (time.sleep(delay), block.notify(newstate)))
+    thread.start()
+    return thread
+
+def test_wait():
+    block = NumpyCommonBlock(x=numpy.zeros(1))
+    start = time.time()
+    assert not block.wait(1, 0.05)
+    assert time.time() - start >= 0.045
+    assert not block.waitmask(~0, 0.01)
+    assert block.wait(0, 0)
+
+    thread = notifylater(block, 6, 0.02)
+    assert block.waitmask(~0, 5)
+    thread.join()
+    assert block.wait(6, 0) and not block.waitmask(1, 0.01) and block.waitmask(2, 0)
+
+    # and the same futex from C++
+    assert cpp.test_wait(block.pointer()) == 0
+    thread = notifylater(block, 12, 0.02)
+    assert block.wait(12, 5)
+    thread.join()
+
+def test_seqlock():
+    block = NumpyCommonBlock(x=numpy.arange(8.0))
+    block.seqlock()
+    block._seqs[0] += 1    # a write in progress
+    assert block.snapshot(3) is None
+    assert block.pandas(maxRetries=3) is None
+    block._seqs[0] += 1
+    assert list(block.snapshot(3)["x"]) == list(range(8))
+    assert block.accessor("x")[2:4].tolist() == [2.0, 3.0]
+
+    assert cpp.test_seqlock(block.pointer()) == 0
+
+def test_slots():
+    block = NumpyCommonBlock.pipelined(3, x=numpy.zeros(4, dtype=numpy.int64))
+    assert block.acquire_for_read(0.01) is None
+    slots = [block.acquire_for_write(0) for i in range(3)]
+    assert slots == [0, 1, 2] and block.acquire_for_write(0.01) is None
+    for slot in slots:
+        block.slot(slot)["x"][:] = slot
+        block.publish(slot)
+    for expected in slots:
+        slot = block.acquire_for_read(0)
+        assert slot == expected and block.slot(slot)["x"].tolist() == [slot] * 4
+        block.release(slot)
+
+    # the C++ test starts where the Python cursors left off, so use a fresh block
+    block = NumpyCommonBlock.pipelined(3, x=numpy.zeros(4, dtype=numpy.int64))
+    assert cpp.test_slots(block.pointer()) == 0
+
+def test_grow():
+    block = NumpyCommonBlock(x=numpy.arange(4.0), y=numpy.zeros(3))
+    assert block.resize("x", 10) and block.capacity("x") == 10 and block._struct.generation == 1
+    assert block.live("x")[:4].tolist() == [0, 1, 2, 3]
+    assert block.resize("x", 2) and block.capacity("x") == 10
+
+    # C++ grows it through the grow callback into Python, and its other accessors follow
+    block = NumpyCommonBlock(x=numpy.arange(4.0))
+    assert cpp.test_grow(block.pointer()) == 0
+    assert block.live("x").tolist() == [0, 1] + list(range(100, 110))
+    assert block._struct.generation > 0
+
+    # a pipelined block grows while the consumer holds a slot, which keeps its view
+    block = NumpyCommonBlock.pipelined(2, x=numpy.zeros(4))
+    slot = block.acquire_for_write(0)
+    block.slot(slot)["x"][:] = [1, 2, 3, 4]
+    block.publish(slot)
+    reading = block.acquire_for_read(0)
+    held = block.slot(reading)["x"]
+    writing = block.acquire_for_write(0)
+    assert block.resize("x", 10, writing) and block.capacity("x") == 10
+    assert held.tolist() == [1, 2, 3, 4] and block.live("x", reading).tolist() == [1, 2, 3, 4]
+    for n in 20, 40, 80:
+        assert block.resize("x", n, writing)
+    assert len(block._retired) == 4                 # all kept while a slot is READING
+    block.release(reading)
+    assert block.resize("x", 200, writing)
+    assert len(block._retired) == 1                 # then only the latest grow's
+
+    # old arrays don't pile up
+    block = NumpyCommonBlock(x=numpy.zeros(1), y=numpy.zeros(1))
+    for n in range(2, 1000, 50):
+        assert block.resize("x", n) and block.resize("y", n)
+        assert len(block._retired) <= 1
+
+def test_snapshot():
+    block = NumpyCommonBlock(x=numpy.arange(8.0))
+    block.seqlock()
+    directory = tempfile.mkdtemp()
+    try:
+        prefix = os.path.join(directory, "snapshot")
+        assert cpp.test_snapshot(block.pointer(), prefix.encode()) == 0
+        assert numpy.load(prefix + "0.npy")["x"].tolist() == list(range(8))
+    finally:
+        shutil.rmtree(directory)
+
+def test_arrow():
+    block = NumpyCommonBlock(x=numpy.arange(8.0), y=numpy.arange(8, dtype=numpy.int32))
+    with block.arrow(["x", "y"]) as batch:
+        assert batch.num_rows == 8 and batch.column(0).to_pylist() == list(range(8))
+        copied = batch.column(1).to_pylist()
+    assert copied == list(range(8))
+
+    # released only by the thread that took the read locks
+    export = block.arrow(["x"])
+    errors = []
+    def elsewhere():
+        try:
+            export.release()
+        except RuntimeError:
+            errors.append(True)
+    thread = threading.Thread(target=elsewhere)
+    thread.start()
+    thread.join()
+    assert errors == [True]
+    export.release()
+    block.accessor("x")[0] = 100    # a writer gets in
+    assert block.live("x")[0] == 100
+
+    assert cpp.test_arrow(block.pointer()) == 0
+    assert block.live("x")[0] == 100
+
+def test_dtypes():
+    block = NumpyCommonBlock(x=numpy.arange(2.0),
+                             s=numpy.array([b"one", b"two"], dtype="|S8"),
+                             r=numpy.array([(1, 2), (3, 4)], dtype=[("a", "<i4"), ("b", "<i4")]))
+    assert cpp.test_dtypes(block.pointer()) == 0
+
+def test_attach():
+    name = "commonblocktest-{0}".format(os.getpid())
+    block = NumpyCommonBlock.shared(name, y=numpy.arange(5, dtype=numpy.int32))
+    try:
+        # another Python process
+        child = os.fork()
+        if child == 0:
+            attached = NumpyCommonBlock.attach(name)
+            ok = attached.live("y").tolist() == list(range(5))
+            attached.notify(1)
+            os._exit(0 if ok else 1)
+        assert block.wait(1, 5)
+        assert os.waitpid(child, 0)[1] == 0
+
+        # a C++ process
+        child = os.fork()
+        if child == 0:
+            os._exit(cpp.test_attach(name.encode()))
+        assert block.wait(2, 5)
+        assert block.live("y").tolist() == [0, 10, 20, 30, 40]
+        block.accessor("y")[0] = 99
+        block.notify(3)
+        assert os.waitpid(child, 0)[1] == 0
+    finally:
+        block.unlink()
+
+if __name__ == "__main__":
+    for name, test in sorted(globals().items()):
+        if name.startswith("test_"):
+            print(name)
+            sys.stdout.flush()
+            test()
+    print("end")
@@ -235,6 +235,7 @@ DemoAnalyzer::DemoAnalyzer(const edm::ParameterSet& iConfig)
            if(j==1) cname << name.str() << "_y";
            if(j==2) cname << name.str() << "_z";
            c2numpy_addcolumn(&writer, cname.str().c_str(), C2NUMPY_FLOAT64);
+           c2numpy_nullable(&writer, cname.str());   // absent hits are null, not (0, 0, 0)
        }
    }
 
@@ -247,6 +248,7 @@ DemoAnalyzer::DemoAnalyzer(const edm::ParameterSet& iConfig)
            if(j==1) cname << name.str() << "_y";
            if(j==2) cname << name.str() << "_z";
            c2numpy_addcolumn(&writer, cname.str().c_str(), C2NUMPY_FLOAT64);
+           c2numpy_nullable(&writer, cname.str());   // absent hits are null, not (0, 0, 0)
        }
    }
 
@@ -330,9 +332,9 @@ DemoAnalyzer::analyze(const edm::Event& iEvent, const edm::EventSetup& iSetup)
        }
        // fill the rest
        for(auto i=npxhits; i < max_pxhits; ++i){
-           c2numpy_float64(&writer, 0.); // init x
-           c2numpy_float64(&writer, 0.); // init y
-           c2numpy_float64(&writer, 0.); // init z
+           c2numpy_null(&writer); // x
+           c2numpy_null(&writer); // y
+           c2numpy_null(&writer); // z
        }
 
        // extract SiStripClusters
@@ -348,9 +350,9 @@ DemoAnalyzer::analyze(const edm::Event& iEvent, const edm::EventSetup& iSetup)
        }
        // fill the rest
        for(auto i=nsihits; i < max_sihits; ++i){
-           c2numpy_float64(&writer, 0.); // init x
-           c2numpy_float64(&writer, 0.); // init y
-           c2numpy_float64(&writer, 0.); // init z
+           c2numpy_null(&writer); // x
+           c2numpy_null(&writer); // y
+           c2numpy_null(&writer); // z
        }
        LogInfo("Demo") << "track "<< tidx << "# pixel hits" << npxhits << "# sihits" << nsihits;
 
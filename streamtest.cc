@@ -0,0 +1,137 @@
+// Copyright 2016 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stand-in consumer for c2numpy_use_stream: listens on a Unix domain socket, forks a producer
+// that streams rows into it, and checks every chunk as it arrives.
+//
+//     ./streamtest [socket-path] [rows] [rowsPerChunk]
+//
+// With a socket path and no producer (rows = 0), it only listens, so that another process
+// (e.g. a real producer) can connect.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "c2numpy.h"
+#include "c2numpy_reader.h"
+
+static int produce(const char *path, int64_t rows, int32_t rowsPerChunk) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    perror("connect");
+    return 1;
+  }
+
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "stream", rowsPerChunk);
+  c2numpy_use_stream(&writer, fd);
+  c2numpy_addcolumn(&writer, "index", C2NUMPY_INT64);
+  c2numpy_addcolumn(&writer, "value", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "label", (c2numpy_type)(C2NUMPY_STRING + 4));
+
+  int status = 0;
+  for (int64_t i = 0;  i < rows;  ++i) {
+    status |= c2numpy_int64(&writer, i);
+    status |= c2numpy_float64(&writer, i * 0.5);
+    status |= c2numpy_string(&writer, i % 2 == 0 ? "even" : "odd\0");
+    if (i % 1000 == 999)
+      status |= c2numpy_rotate(&writer);   // e.g. at the end of an event: don't keep the consumer waiting
+  }
+  status |= c2numpy_close(&writer);
+  close(fd);
+  return status == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/tmp/c2numpy-streamtest.sock";
+  int64_t rows = argc > 2 ? atoll(argv[2]) : 100000;
+  int32_t rowsPerChunk = argc > 3 ? atoi(argv[3]) : 256;
+
+  unlink(path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0  ||  listen(listener, 1) != 0) {
+    perror("bind/listen");
+    return 1;
+  }
+
+  pid_t producer = 0;
+  if (rows > 0) {
+    producer = fork();
+    if (producer == 0)
+      _exit(produce(path, rows, rowsPerChunk));
+  }
+
+  int fd = accept(listener, NULL, NULL);
+  c2numpy_reader reader;
+  c2numpy_reader_init(&reader, fd);
+
+  int64_t expected = 0;
+  int64_t chunks = 0;
+  int failed = 0;
+  int status;
+  while ((status = c2numpy_read_chunk(&reader)) == 1) {
+    chunks++;
+    if (reader.rowSize != 8 + 8 + 4  ||  reader.numRows > rowsPerChunk) {
+      fprintf(stderr, "chunk %" PRId64 ": unexpected shape or record size\n", chunks);
+      failed = 1;
+      break;
+    }
+    for (int64_t row = 0;  row < reader.numRows;  ++row) {
+      int64_t index;
+      double value;
+      memcpy(&index, &reader.data[row * reader.rowSize], 8);
+      memcpy(&value, &reader.data[row * reader.rowSize + 8], 8);
+      if (index != expected  ||  value != expected * 0.5) {
+        fprintf(stderr, "chunk %" PRId64 " row %" PRId64 ": expected %" PRId64 ", got %" PRId64 "\n", chunks, row, expected, index);
+        failed = 1;
+      }
+      expected++;
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "malformed chunk after %" PRId64 " rows\n", expected);
+    failed = 1;
+  }
+  close(fd);
+  close(listener);
+  unlink(path);
+
+  if (producer > 0) {
+    int producerStatus;
+    waitpid(producer, &producerStatus, 0);
+    if (!WIFEXITED(producerStatus)  ||  WEXITSTATUS(producerStatus) != 0) {
+      fprintf(stderr, "producer failed\n");
+      failed = 1;
+    }
+    if (expected != rows) {
+      fprintf(stderr, "expected %" PRId64 " rows, got %" PRId64 "\n", rows, expected);
+      failed = 1;
+    }
+  }
+
+  printf("{\"rows\": %" PRId64 ", \"chunks\": %" PRId64 ", \"ok\": %s}\n", expected, chunks, failed ? "false" : "true");
+  return failed;
+}
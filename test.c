@@ -17,6 +17,257 @@
 
 #include "c2numpy.h"
 
+// collects what the callback sink hands over, file by file, as a consumer reassembling them would
+int collect(void *userData, const char *fileName, int64_t offset, const void *data, size_t size) {
+  std::vector<std::pair<std::string, std::string> > *files = (std::vector<std::pair<std::string, std::string> >*)userData;
+  if (files->empty()  ||  files->back().first != fileName)
+    files->push_back(std::make_pair(std::string(fileName), std::string()));
+  std::string &contents = files->back().second;
+  if (data != NULL) {
+    if (contents.size() < offset + size)
+      contents.resize(offset + size);
+    contents.replace(offset, size, (const char*)data, size);
+  }
+  return 0;
+}
+
+#define CHECK(condition, message)                                          \
+  if (!(condition)) {                                                      \
+    printf("FAIL: %s\n", message);                                         \
+    return 1;                                                              \
+  }
+
+// The writers below make the datasets that test.py reads back (with c2numpy.py, pyarrow and
+// c2numpy-verify) and compares with the same formulas: row i of each is a function of i.
+
+// nullable, category, flags and transformed columns, in 3 files
+int write_columns() {
+  const char *labels[3] = {"ee", "mumu", "emu"};
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-columns-", 40);
+  c2numpy_addcolumn(&writer, "event", C2NUMPY_INT64);
+  c2numpy_addcolumn(&writer, "x", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "label", C2NUMPY_CATEGORY);
+  c2numpy_addflags(&writer, "bits", {"trigger", "isolated", "prompt"});
+  c2numpy_addcolumn(&writer, "down", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "quant", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "trunc", C2NUMPY_FLOAT64);
+  CHECK(c2numpy_nullable(&writer, "x") == 0, "c2numpy_nullable");
+  CHECK(c2numpy_downcast(&writer, "down", C2NUMPY_FLOAT32) == 0, "c2numpy_downcast");
+  CHECK(c2numpy_quantize(&writer, "quant", C2NUMPY_INT16, 0.01, 10.0) == 0, "c2numpy_quantize");
+  CHECK(c2numpy_truncate(&writer, "trunc", 20) == 0, "c2numpy_truncate");
+
+  for (int i = 0;  i < 100;  ++i) {
+    c2numpy_int64(&writer, i);
+    if (i % 7 == 3)
+      c2numpy_null(&writer);
+    else
+      c2numpy_float64(&writer, i * 0.5);
+    c2numpy_category(&writer, labels[i % 3]);
+    c2numpy_flags(&writer, i % 8);
+    c2numpy_float64(&writer, i / 3.0);
+    c2numpy_float64(&writer, 10.0 + 0.25 * i);
+    c2numpy_float64(&writer, i * 1.1);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-columns-");
+  return 0;
+}
+
+// the same 3 float64 columns as a matrix, in C and in Fortran order
+int write_matrix(const char *prefix, int fortranOrder) {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, prefix, 25);
+  c2numpy_addcolumn(&writer, "a", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "b", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "c", C2NUMPY_FLOAT64);
+  CHECK(c2numpy_matrix(&writer, fortranOrder) == 0, "c2numpy_matrix");
+  for (int i = 0;  i < 60;  ++i) {
+    c2numpy_float64(&writer, i);
+    c2numpy_float64(&writer, 2.0 * i);
+    c2numpy_float64(&writer, 3.0 * i);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing a matrix");
+  return 0;
+}
+
+// Arrow IPC files with nulls
+int write_arrow() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-arrow-", 30);
+  c2numpy_addcolumn(&writer, "n", C2NUMPY_INT32);
+  c2numpy_addcolumn(&writer, "y", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "odd", C2NUMPY_BOOL);
+  c2numpy_nullable(&writer, "y");
+  CHECK(c2numpy_arrow_ipc(&writer) == 0, "c2numpy_arrow_ipc");
+  for (int i = 0;  i < 70;  ++i) {
+    c2numpy_int32(&writer, i);
+    if (i % 5 == 0)
+      c2numpy_null(&writer);
+    else
+      c2numpy_float64(&writer, i * 1.5);
+    c2numpy_bool(&writer, i % 2);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-arrow-");
+  return 0;
+}
+
+// files sorted by a nullable key, with key ranges
+int write_sorted() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-sorted-", 50);
+  c2numpy_addcolumn(&writer, "run", C2NUMPY_INT32);
+  c2numpy_addcolumn(&writer, "x", C2NUMPY_FLOAT64);
+  c2numpy_addcolumn(&writer, "i", C2NUMPY_INT64);
+  c2numpy_nullable(&writer, "x");
+  CHECK(c2numpy_sortby(&writer, {"run", "x"}) == 0, "c2numpy_sortby");
+  for (int i = 0;  i < 120;  ++i) {
+    c2numpy_int32(&writer, (i * 7) % 5);
+    if (i % 11 == 0)
+      c2numpy_null(&writer);
+    else
+      c2numpy_float64(&writer, (i * 13) % 17);
+    c2numpy_int64(&writer, i);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-sorted-");
+  return 0;
+}
+
+// events of 1 to 4 tracks, indexed by (run, event), across files of 16 rows
+int write_groups() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-groups-", 16);
+  c2numpy_addcolumn(&writer, "run", C2NUMPY_INT64);
+  c2numpy_addcolumn(&writer, "event", C2NUMPY_INT64);
+  c2numpy_addcolumn(&writer, "track", C2NUMPY_INT32);
+  CHECK(c2numpy_groupby(&writer, {"run", "event"}) == 0, "c2numpy_groupby");
+  for (int event = 29;  event >= 0;  --event) {   // written out of key order
+    CHECK(c2numpy_begin_group(&writer, {event / 10, event}) == 0, "c2numpy_begin_group");
+    for (int track = 0;  track < event % 4 + 1;  ++track) {
+      c2numpy_int64(&writer, event / 10);
+      c2numpy_int64(&writer, event);
+      c2numpy_int32(&writer, track);
+    }
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-groups-");
+  return 0;
+}
+
+int nonnegative(void *userData, const char *row) {
+  double x;
+  memcpy(&x, row + *(int64_t*)userData, 8);
+  return x >= 0.0;
+}
+
+// rows with x >= 0 of half of the events (3 rows each); and a sample of 10 rows of every 40
+int write_selected() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-selected-", 100);
+  c2numpy_addcolumn(&writer, "event", C2NUMPY_INT64);
+  c2numpy_addcolumn(&writer, "x", C2NUMPY_FLOAT64);
+  int64_t offset = c2numpy_offset(&writer, "x");
+  CHECK(c2numpy_filter(&writer, nonnegative, &offset) == 0, "c2numpy_filter");
+  CHECK(c2numpy_prescale(&writer, "event", 0.5) == 0, "c2numpy_prescale");
+  for (int i = 0;  i < 600;  ++i) {
+    c2numpy_int64(&writer, i / 3);
+    c2numpy_float64(&writer, i % 10 - 3);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-selected-");
+
+  c2numpy_writer sampled;
+  c2numpy_init(&sampled, "testout-sampled-", 40);
+  c2numpy_addcolumn(&sampled, "i", C2NUMPY_INT64);
+  CHECK(c2numpy_sample(&sampled, 10, 12345) == 0, "c2numpy_sample");
+  for (int i = 0;  i < 100;  ++i)
+    c2numpy_int64(&sampled, i);
+  CHECK(c2numpy_close(&sampled) == 0, "closing testout-sampled-");
+  return 0;
+}
+
+// statistics of a nullable column with nan, per file and for the run; and checksums of every 64 bytes
+int write_summarized() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-summarized-", 60);
+  c2numpy_addcolumn(&writer, "x", C2NUMPY_FLOAT64);
+  c2numpy_nullable(&writer, "x");
+  CHECK(c2numpy_summarize(&writer, "x", 10, 0.0, 100.0) == 0, "c2numpy_summarize");
+  CHECK(c2numpy_checksums(&writer, 64) == 0, "c2numpy_checksums");
+  for (int i = 0;  i < 150;  ++i) {
+    if (i % 9 == 0)
+      c2numpy_null(&writer);
+    else
+      c2numpy_float64(&writer, i % 13 == 0 ? NAN : i % 120 - 5);
+  }
+  CHECK(c2numpy_close(&writer) == 0, "closing testout-summarized-");
+  return 0;
+}
+
+// the staged rows through the Arrow C Data Interface, checked here: nothing is written
+int check_arrow_export() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-export-", 100);
+  c2numpy_use_memory(&writer);
+  c2numpy_addcolumn(&writer, "n", C2NUMPY_INT32);
+  c2numpy_addcolumn(&writer, "y", C2NUMPY_FLOAT64);
+  c2numpy_nullable(&writer, "y");
+  for (int i = 0;  i < 10;  ++i) {
+    c2numpy_int32(&writer, i);
+    if (i == 4)
+      c2numpy_null(&writer);
+    else
+      c2numpy_float64(&writer, i * 0.5);
+  }
+  c2numpy_int32(&writer, 10);
+  struct ArrowSchema schema;
+  struct ArrowArray array;
+  CHECK(c2numpy_arrow(&writer, &schema, &array) == -1, "c2numpy_arrow in the middle of a row");
+  c2numpy_float64(&writer, 5.0);
+
+  CHECK(c2numpy_arrow(&writer, &schema, &array) == 0, "c2numpy_arrow");
+  CHECK(array.length == 11  &&  array.n_children == 2  &&  schema.n_children == 2, "exported shape");
+  CHECK(std::string(schema.children[0]->name) == "n"  &&  std::string(schema.children[0]->format) == "i", "exported schema of n");
+  CHECK(std::string(schema.children[1]->name) == "y"  &&  std::string(schema.children[1]->format) == "g", "exported schema of y");
+  const int32_t *n = (const int32_t*)array.children[0]->buffers[1];
+  const double *y = (const double*)array.children[1]->buffers[1];
+  const uint8_t *valid = (const uint8_t*)array.children[1]->buffers[0];
+  bool same = array.children[1]->null_count == 1  &&  valid != NULL;
+  for (int i = 0;  same  &&  i < 11;  ++i)
+    same = n[i] == i  &&  ((valid[i / 8] >> (i % 8)) & 1) == (i != 4)  &&  (i == 4  ||  y[i] == i * 0.5);
+  CHECK(same, "exported values and validity");
+  array.release(&array);
+  schema.release(&schema);
+  CHECK(array.release == NULL  &&  schema.release == NULL, "exported structs released");
+  c2numpy_close(&writer);
+  return 0;
+}
+
+#ifdef C2NUMPY_STATS
+void countcalls(const c2numpy_stats * /* stats */, void *userData) {
+  *(int*)userData += 1;
+}
+
+// the counters of a writer of 25 rows of 2 columns in files of 10 rows
+int check_stats() {
+  c2numpy_writer writer;
+  c2numpy_init(&writer, "testout-stats-", 10);
+  c2numpy_use_memory(&writer);
+  c2numpy_addcolumn(&writer, "n", C2NUMPY_INT32);
+  c2numpy_addcolumn(&writer, "y", C2NUMPY_FLOAT64);
+  int calls = 0;
+  CHECK(c2numpy_stats_callback(&writer, 5, countcalls, &calls) == 0, "c2numpy_stats_callback");
+  for (int i = 0;  i < 25;  ++i) {
+    c2numpy_int32(&writer, i);
+    c2numpy_float64(&writer, i);
+  }
+  c2numpy_close(&writer);
+  const c2numpy_stats *stats = c2numpy_getstats(&writer);
+  CHECK(stats->rows == 25  &&  stats->items == 50, "counted rows and items");
+  CHECK(stats->filesOpened == 3  &&  stats->filesRotated == 2, "counted files");
+  CHECK(stats->writeTime.count == 50  &&  stats->closeTime.count == 1, "timed calls");
+  CHECK(calls == 5, "stats callback every 5 rows");
+  return 0;
+}
+#endif
+
 int main(int argc, char **argv) {
   printf("start\n");
 
@@ -57,5 +308,76 @@ int main(int argc, char **argv) {
   printf("close\n");
   c2numpy_close(&writer);
 
+  // sidecars through the callback sink must arrive under their own names
+  printf("callback sink with a sidecar\n");
+  std::vector<std::pair<std::string, std::string> > files;
+  c2numpy_writer callback;
+  c2numpy_init(&callback, "cb", 2);
+  c2numpy_use_callback(&callback, collect, &files);
+  c2numpy_addcolumn(&callback, "one", C2NUMPY_INTC);
+  c2numpy_nullable(&callback, "one");
+  c2numpy_intc(&callback, 1);
+  c2numpy_null(&callback);
+  c2numpy_intc(&callback, 3);
+  c2numpy_close(&callback);
+
+  const char *expected[4] = {"cb0.npy", "cb0.valid.npy", "cb1.npy", NULL};
+  for (size_t i = 0;  i < files.size()  ||  expected[i] != NULL;  ++i) {
+    if (i >= files.size()  ||  expected[i] == NULL  ||  files[i].first != expected[i]) {
+      printf("FAIL: file %d is %s\n", (int)i, i < files.size() ? files[i].first.c_str() : "missing");
+      return 1;
+    }
+    if (files[i].second.compare(0, 6, "\x93NUMPY") != 0) {
+      printf("FAIL: %s doesn't start with a .npy header\n", files[i].first.c_str());
+      return 1;
+    }
+    printf("  %s: %d bytes\n", files[i].first.c_str(), (int)files[i].second.size());
+  }
+
+  // a stream has no sidecars, so what needs one is refused rather than lost
+  printf("stream without sidecars\n");
+  c2numpy_writer categories;
+  c2numpy_init(&categories, "stream", 10);
+  c2numpy_addcolumn(&categories, "label", C2NUMPY_CATEGORY);
+  if (c2numpy_use_stream(&categories, -1) != -1) {
+    printf("FAIL: a stream took a category column\n");
+    return 1;
+  }
+  c2numpy_writer stream;
+  c2numpy_init(&stream, "stream", 10);
+  c2numpy_addcolumn(&stream, "x", C2NUMPY_FLOAT64);
+  c2numpy_use_stream(&stream, -1);
+  if (c2numpy_addcolumn(&stream, "label", C2NUMPY_CATEGORY) != -1  ||  c2numpy_downcast(&stream, "x", C2NUMPY_FLOAT32) != -1  ||  c2numpy_nullable(&stream, "x") != -1) {
+    printf("FAIL: a .npy stream took a category, transform or nullable column\n");
+    return 1;
+  }
+  c2numpy_arrow_ipc(&stream);
+  if (c2numpy_nullable(&stream, "x") != 0) {
+    printf("FAIL: an Arrow IPC stream refused a nullable column\n");
+    return 1;
+  }
+  c2numpy_writer nulls;
+  c2numpy_init(&nulls, "stream", 10);
+  c2numpy_addcolumn(&nulls, "x", C2NUMPY_FLOAT64);
+  c2numpy_nullable(&nulls, "x");
+  c2numpy_use_stream(&nulls, -1);
+  if (c2numpy_open(&nulls) != -1) {
+    printf("FAIL: a .npy stream opened with a nullable column\n");
+    return 1;
+  }
+
+  // for test.py to read back
+  printf("round trips\n");
+  if (write_columns() != 0  ||  write_matrix("testout-matrix-", 0) != 0  ||  write_matrix("testout-fortran-", 1) != 0  ||
+      write_arrow() != 0  ||  write_sorted() != 0  ||  write_groups() != 0  ||  write_selected() != 0  ||  write_summarized() != 0)
+    return 1;
+  printf("arrow export\n");
+  if (check_arrow_export() != 0) return 1;
+#ifdef C2NUMPY_STATS
+  printf("stats\n");
+  if (check_stats() != 0) return 1;
+#endif
+
   printf("end\n");
+  return 0;
 }
@@ -0,0 +1,183 @@
+# Copyright 2016 Jim Pivarski
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Reads back the testout-* datasets that testme writes (test.c) and compares them with the formulas they
+# were written from: run with "make test".
+
+import glob
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import numpy
+
+import c2numpy
+
+def rows(number, perFile, total):
+    return range(number * perFile, min((number + 1) * perFile, total))
+
+def test_columns():
+    prefix = "testout-columns-"
+    labels = ["ee", "mumu", "emu"]
+    assert c2numpy.flagnames(prefix, "bits") == ["trigger", "isolated", "prompt"]
+    assert c2numpy.categories(prefix, "label").tolist() == [b"ee", b"mumu", b"emu"]
+    for number in range(3):
+        i = numpy.array(rows(number, 40, 100))
+        raw = numpy.load("{0}{1}.npy".format(prefix, number))
+        assert raw["down"].dtype == numpy.float32 and raw["quant"].dtype == numpy.int16
+
+        data = c2numpy.load(prefix, number)
+        assert data["event"].tolist() == i.tolist()
+        assert data["x"].mask.tolist() == (i % 7 == 3).tolist()
+        assert data["x"].compressed().tolist() == (i[i % 7 != 3] * 0.5).tolist()
+        assert list(c2numpy.categorical(prefix, "label", raw["label"]).astype(str)) == [labels[k % 3] for k in i]
+
+        bits = c2numpy.flags(prefix, "bits", raw["bits"])
+        for bit, name in enumerate(["trigger", "isolated", "prompt"]):
+            assert bits[name].tolist() == ((i >> bit) & 1 == 1).tolist()
+
+        assert data["down"].dtype == numpy.float64 and numpy.allclose(data["down"], i / 3.0, rtol=1e-7, atol=0)
+        assert numpy.allclose(data["quant"], 10.0 + 0.25 * i, rtol=0, atol=0.005)
+        assert numpy.allclose(data["trunc"], i * 1.1, rtol=2.0**-20, atol=0)
+        assert numpy.all(raw["trunc"].view(numpy.uint64) & numpy.uint64((1 << 32) - 1) == 0)
+
+def test_matrix():
+    for prefix, fortran in ("testout-matrix-", False), ("testout-fortran-", True):
+        assert c2numpy.columns(prefix) == ["a", "b", "c"]
+        for number in range(3):
+            i = numpy.array(rows(number, 25, 60), dtype=numpy.float64)
+            data = numpy.load("{0}{1}.npy".format(prefix, number))
+            assert data.shape == (len(i), 3) and data.dtype == numpy.float64
+            assert data.flags.f_contiguous == fortran or len(i) == 1
+            assert data.tolist() == numpy.column_stack([i, 2 * i, 3 * i]).tolist()
+
+def test_arrow():
+    import pyarrow
+    for number in range(3):
+        i = list(rows(number, 30, 70))
+        table = pyarrow.ipc.open_file(pyarrow.memory_map("testout-arrow-{0}.arrow".format(number))).read_all()
+        assert table.column_names == ["n", "y", "odd"] and table.num_rows == len(i)
+        assert table.column("n").to_pylist() == i
+        assert table.column("y").to_pylist() == [None if k % 5 == 0 else k * 1.5 for k in i]
+        assert table.column("odd").to_pylist() == [k % 2 == 1 for k in i]
+
+def test_sorted():
+    prefix = "testout-sorted-"
+    ranges = c2numpy.keyranges(prefix)
+    assert ranges["number"].tolist() == [0, 1, 2]
+    for number in range(3):
+        i = list(rows(number, 50, 120))
+        run = dict((k, (k * 7) % 5) for k in i)
+        x = dict((k, None if k % 11 == 0 else (k * 13) % 17) for k in i)
+
+        # by run, then x with nulls last, then write order
+        expected = sorted(i, key=lambda k: (run[k], x[k] is None, x[k] or 0, k))
+        data = c2numpy.load(prefix, number)
+        assert data["i"].tolist() == expected
+        assert data["run"].tolist() == [run[k] for k in expected]
+        assert data["x"].mask.tolist() == [x[k] is None for k in expected]
+
+        values = [x[k] for k in i if x[k] is not None]
+        assert (ranges["run_min"][number], ranges["run_max"][number]) == (min(run.values()), max(run.values()))
+        assert (ranges["x_min"][number], ranges["x_max"][number]) == (min(values), max(values))
+    assert c2numpy.select(prefix, "x", 100, 200) == []
+
+def test_groups():
+    prefix = "testout-groups-"
+    groups = numpy.load(prefix + "groups.npy")
+    assert [(g["run"], g["event"]) for g in groups] == [(event // 10, event) for event in range(30)]
+    for event in range(30):
+        group = c2numpy.group(prefix, event // 10, event)
+        assert group["track"].tolist() == list(range(event % 4 + 1))
+        assert set(group["run"].tolist()) == set([event // 10]) and set(group["event"].tolist()) == set([event])
+    assert c2numpy.group(prefix, 9, 9) is None
+
+def test_selected():
+    data = numpy.concatenate([numpy.load(name) for name in sorted(glob.glob("testout-selected-*.npy"))])
+    kept = set(data["event"].tolist())
+    eligible = set(i // 3 for i in range(600) if i % 10 >= 3)
+    assert kept <= eligible and 0.3 < len(kept) / float(len(eligible)) < 0.7
+
+    # filtered rows of whole events, in write order
+    expected = [(i // 3, i % 10 - 3) for i in range(600) if i % 10 >= 3 and i // 3 in kept]
+    assert [(e, x) for e, x in data.tolist()] == expected
+
+    for number in range(3):
+        data = numpy.load("testout-sampled-{0}.npy".format(number))["i"].tolist()
+        chunk = list(rows(number, 40, 100))
+        assert len(data) == 10 and len(set(data)) == 10 and set(data) <= set(chunk)
+
+def expected_summary(i):
+    values = [k % 120 - 5.0 for k in i if k % 9 != 0 and k % 13 != 0]
+    mean = sum(values) / len(values)
+    bins = [0] * 12
+    for value in values:
+        bins[0 if value < 0 else 11 if value >= 100 else int(value / 10.0) + 1] += 1
+    return {"rows": len(i), "count": len(values), "nulls": len([k for k in i if k % 9 == 0]),
+            "nans": len([k for k in i if k % 9 != 0 and k % 13 == 0]), "mean": mean,
+            "variance": sum((value - mean)**2 for value in values) / len(values),
+            "min": min(values), "max": max(values), "underflow": bins[0], "overflow": bins[-1], "bins": bins[1:-1]}
+
+def same_summary(summary, expected):
+    x = summary["columns"]["x"]
+    assert summary["rows"] == expected["rows"]
+    for name in "count", "nulls", "nans", "min", "max", "underflow", "overflow", "bins":
+        assert x[name] == expected[name], name
+    assert math.isclose(x["mean"], expected["mean"]) and math.isclose(x["variance"], expected["variance"])
+    assert (x["low"], x["high"]) == (0, 100)
+
+def test_summarized():
+    prefix = "testout-summarized-"
+    for number in range(3):
+        same_summary(c2numpy.summary(prefix, number), expected_summary(list(rows(number, 60, 150))))
+    same_summary(c2numpy.summary(prefix), expected_summary(list(range(150))))
+
+    # and the sidecar doesn't change how the file reads
+    data = c2numpy.load(prefix, 0)
+    assert data["x"].mask.tolist() == [k % 9 == 0 for k in range(60)]
+
+def test_checksums():
+    prefix = "testout-summarized-"
+    with open(prefix + "checksums.txt") as file:
+        lines = [line.split() for line in file]
+    assert [line[0] for line in lines] == ["0.npy", "1.npy", "2.npy"]
+    for line in lines:
+        assert int(line[1]) == os.path.getsize(prefix + line[0])
+        assert line[3] == "64" and len(line) == 4 + (int(line[1]) + 63) // 64
+    assert subprocess.call(["./c2numpy-verify", prefix], stdout=subprocess.DEVNULL) == 0
+
+    # a copy with one byte changed doesn't pass
+    directory = tempfile.mkdtemp()
+    try:
+        for name in glob.glob(prefix + "*"):
+            shutil.copy(name, directory)
+        with open(os.path.join(directory, prefix + "1.npy"), "r+b") as file:
+            file.seek(300)
+            byte = file.read(1)
+            file.seek(300)
+            file.write(bytes([byte[0] ^ 1]))
+        assert subprocess.call(["./c2numpy-verify", os.path.join(directory, prefix)], stdout=subprocess.DEVNULL) == 1
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == "__main__":
+    for name, test in sorted(globals().items()):
+        if name.startswith("test_"):
+            print(name)
+            sys.stdout.flush()
+            test()
+    print("end")
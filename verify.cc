@@ -0,0 +1,123 @@
+// Copyright 2016 Jim Pivarski
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the files of a dataset against the <prefix>checksums.txt that c2numpy_checksums wrote,
+// several files at a time.
+//
+//     ./c2numpy-verify prefix [threads]
+//
+// Prints each file that is missing, has the wrong size, or doesn't match its CRC32C (and which blocks
+// don't, if the manifest has blocks), and exits with 1 if there were any.
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "c2numpy.h"
+#include "c2numpy_reader.h"
+
+struct Entry {
+    std::string name;
+    int64_t bytes;
+    uint32_t checksum;
+    int64_t blockSize;
+    std::vector<uint32_t> blocks;
+    std::string problem;   // empty if the file matches
+};
+
+void verify(const std::string &prefix, Entry &entry) {
+    int fd = open((prefix + entry.name).c_str(), O_RDONLY);
+    if (fd == -1) {
+        entry.problem = strerror(errno);
+        return;
+    }
+
+    // read a block at a time (or a MiB at a time, without blocks)
+    std::vector<char> buffer(entry.blockSize > 0 ? entry.blockSize : 1 << 20);
+    uint32_t checksum = 0;
+    int64_t bytes = 0;
+    std::stringstream badBlocks;
+    while (true) {
+        int64_t got = c2numpy_read_fully(fd, &buffer[0], buffer.size());
+        if (got <= 0) break;
+        checksum = c2numpy_crc32c(checksum, &buffer[0], got);
+        if (entry.blockSize > 0) {
+            size_t block = bytes / entry.blockSize;
+            if (block >= entry.blocks.size()  ||  c2numpy_crc32c(0, &buffer[0], got) != entry.blocks[block])
+                badBlocks << " " << block;
+        }
+        bytes += got;
+        if (got < (int64_t)buffer.size()) break;
+    }
+    close(fd);
+
+    if (bytes != entry.bytes) {
+        std::stringstream problem;
+        problem << bytes << " bytes instead of " << entry.bytes;
+        entry.problem = problem.str();
+    }
+    else if (checksum != entry.checksum)
+        entry.problem = "wrong CRC32C" + (badBlocks.str() == "" ? "" : " in block(s)" + badBlocks.str());
+}
+
+// each thread takes the next unchecked file until there are none
+void worker(const std::string *prefix, std::vector<Entry> *entries, std::atomic<size_t> *next) {
+    for (size_t i = (*next)++;  i < entries->size();  i = (*next)++)
+        verify(*prefix, (*entries)[i]);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2  ||  argc > 3) {
+        std::cerr << "usage: " << argv[0] << " prefix [threads]" << std::endl;
+        return 2;
+    }
+    std::string prefix = argv[1];
+    int numThreads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    if (numThreads < 1) numThreads = 1;
+
+    std::ifstream manifest((prefix + "checksums.txt").c_str());
+    if (!manifest) {
+        std::cerr << "can't read " << prefix << "checksums.txt" << std::endl;
+        return 2;
+    }
+    std::vector<Entry> entries;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        std::stringstream fields(line);
+        Entry entry;
+        entry.blockSize = 0;
+        fields >> entry.name >> entry.bytes >> std::hex >> entry.checksum >> std::dec >> entry.blockSize;
+        uint32_t block;
+        while (fields >> std::hex >> block)
+            entry.blocks.push_back(block);
+        entries.push_back(entry);
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0;  i < numThreads;  ++i)
+        threads.push_back(std::thread(worker, &prefix, &entries, &next));
+    for (size_t i = 0;  i < threads.size();  ++i)
+        threads[i].join();
+
+    int bad = 0;
+    for (size_t i = 0;  i < entries.size();  ++i)
+        if (entries[i].problem != "") {
+            std::cout << prefix << entries[i].name << ": " << entries[i].problem << std::endl;
+            bad += 1;
+        }
+    std::cout << entries.size() - bad << " of " << entries.size() << " files OK" << std::endl;
+    return bad == 0 ? 0 : 1;
+}